@@ -64,13 +64,14 @@ admin_commands::dump_diagnostics(std::ostream& out, const nlohmann::json& msg)
 void
 admin_commands::admin_diagnostics(std::ostream& out)
 {
-    int sbs_msg_id = m_context.gql_manager.subscribe_to_data_stream();
+    data_stream_subscription sbs(m_context.gql_manager);
+    int sbs_msg_id = sbs.id();
     int msg_id = m_context.gql_manager.admin_diagnostics();
 
     while(true) {
         auto response = m_context.gql_manager.wait_for_response({msg_id, sbs_msg_id});
         if(response.first) {
-            out << "interrupted..." << std::endl;
+            out << (response.first == gql_connection_manager::TIMED_OUT ? "request timed out..." : "interrupted...") << std::endl;
             break;
         }
 
@@ -90,7 +91,7 @@ admin_commands::admin_diagnostics(std::ostream& out)
             }
             if(data_msg["id"] == sbs_msg_id) {
                 if(data_msg["payload"].contains("data")) {
-                    auto msg = nlohmann::json::parse(data_msg["payload"]["data"]["subsData"]["message"].get<std::string>());
+                    auto msg = gql_connection_manager::data_stream_event(data_msg);
                     dump_diagnostics(out, msg);
                     return;
                 } else {
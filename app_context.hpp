@@ -17,6 +17,8 @@ struct app_context
 {
     static constexpr semver::version version{0, 0, 2, semver::prerelease::rc, 2};
     static constexpr semver::version api_version{0, 0, 1};
+    // proxy target of the workspace sync server, not a session name.
+    static constexpr const char* RSYNC_PROXY_TARGET = "rsync";
 
     app_context();
     app_context(const app_context&) = delete;
@@ -48,6 +50,8 @@ struct app_context
 
     std::string username;
     std::string token;
+    // how this executable is invoked, for the ProxyCommand of ssh.
+    std::string program = "metriffic";
 
 private:
     std::thread gql_manager_thread;
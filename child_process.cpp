@@ -0,0 +1,148 @@
+#include "child_process.hpp"
+#include <plog/Log.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace metriffic
+{
+
+child_process::~child_process()
+{
+    if(m_pid > 0 && !m_exited) {
+        terminate(std::chrono::milliseconds(500));
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool
+child_process::start(const std::string& commandline, std::string& error)
+{
+    return start(std::vector<std::string>{"/bin/sh", "-c", commandline}, error);
+}
+
+bool
+child_process::start(const std::vector<std::string>& argv, std::string& error)
+{
+    if(argv.empty()) {
+        error = "nothing to run";
+        return false;
+    }
+    int fds[2];
+    // no pipe2() on macOS.
+    if(pipe(fds) != 0) {
+        error = std::string("pipe: ") + std::strerror(errno);
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // in a group of its own the child can't read the terminal anyway.
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char*> args;
+    for(const auto& a : argv) {
+        args.push_back(const_cast<char*>(a.c_str()));
+    }
+    args.push_back(nullptr);
+    int ret = posix_spawnp(&m_pid, args[0], &actions, &attr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if(ret != 0) {
+        close(fds[0]);
+        m_pid = -1;
+        error = std::string("posix_spawn: ") + std::strerror(ret);
+        return false;
+    }
+    m_fd = fds[0];
+    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+    std::string commandline;
+    for(const auto& a : argv) {
+        commandline += (commandline.empty() ? "" : " ") + a;
+    }
+    PLOGV << "started process group " << m_pid << ": " << commandline;
+    return true;
+}
+
+ssize_t
+child_process::read(char* buffer, size_t size)
+{
+    ssize_t n;
+    do {
+        n = ::read(m_fd, buffer, size);
+    } while(n < 0 && errno == EINTR);
+    return n;
+}
+
+bool
+child_process::reap(bool block)
+{
+    if(m_exited) {
+        return true;
+    }
+    pid_t ret;
+    do {
+        ret = waitpid(m_pid, &m_status, block ? 0 : WNOHANG);
+    } while(ret < 0 && errno == EINTR);
+    if(ret == m_pid || (ret < 0 && errno == ECHILD)) {
+        m_exited = true;
+    }
+    return m_exited;
+}
+
+void
+child_process::terminate(std::chrono::milliseconds grace)
+{
+    if(m_pid <= 0) {
+        return;
+    }
+    // the shell may be gone already while the rest of the group isn't.
+    PLOGV << "terminating process group " << m_pid;
+    killpg(m_pid, SIGTERM);
+    auto deadline = std::chrono::steady_clock::now() + grace;
+    while(!reap(false)) {
+        if(std::chrono::steady_clock::now() >= deadline) {
+            PLOGW << "process group " << m_pid << " ignored SIGTERM, killing it";
+            killpg(m_pid, SIGKILL);
+            reap(true);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+int
+child_process::wait()
+{
+    if(m_pid <= 0 || !reap(true)) {
+        return -1;
+    }
+    return WIFEXITED(m_status) ? WEXITSTATUS(m_status) : -1;
+}
+
+} // namespace metriffic
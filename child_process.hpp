@@ -0,0 +1,51 @@
+#ifndef CHILD_PROCESS_HPP
+#define CHILD_PROCESS_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/types.h>
+
+namespace metriffic
+{
+
+// a shell command run in its own process group, with its stdout on a
+// non-blocking pipe. The group is signaled as a whole, so that canceling
+// reaches rsync and the ssh it started too, the terminal's ctrl-c doesn't.
+class child_process
+{
+public:
+    child_process() = default;
+    // a child still running by then is terminated.
+    ~child_process();
+    child_process(const child_process&) = delete;
+    child_process& operator=(const child_process&) = delete;
+
+    // through /bin/sh -c.
+    bool start(const std::string& commandline, std::string& error);
+    // no shell involved, argv[0] is looked up in PATH.
+    bool start(const std::vector<std::string>& argv, std::string& error);
+    int output_fd() const { return m_fd; }
+    // > 0 bytes read, 0 at the end of the output, -1 with errno set
+    // (EAGAIN if nothing is there yet).
+    ssize_t read(char* buffer, size_t size);
+
+    // SIGTERM to the group, SIGKILL if it is still around after 'grace'.
+    void terminate(std::chrono::milliseconds grace);
+    // waits for the exit, returns the exit status or -1 if the child was
+    // killed or never started.
+    int wait();
+
+private:
+    bool reap(bool block);
+
+private:
+    pid_t m_pid = -1;
+    int m_fd = -1;
+    bool m_exited = false;
+    int m_status = 0;
+};
+
+} // namespace metriffic
+
+#endif //CHILD_PROCESS_HPP
@@ -2,6 +2,9 @@
 #include <websocketpp/client.hpp>
 #include <boost/thread/thread.hpp>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <plog/Log.h>
 
 #include "gql_connection_manager.hpp"
 
@@ -32,10 +35,74 @@ namespace gql_consts
     static const std::string STOP = "stop"; // Client -> Server
 };
 
+namespace
+{
+    struct operation_document
+    {
+        gql_connection_manager::operation op;
+        bool with_endpoint;
+        bool with_authorization;
+        bool idempotent;
+        int deadline_s;
+        const char* document;
+    };
+
+    // all variables are declared non-null: a non-null variable is accepted 
+    // in both nullable and non-null argument positions. Only idempotent 
+    // operations are re-issued if the connection drops while they're in flight. 
+    // Operations are failed if not answered within their deadline (0 - never).
+    const operation_document gql_operations[] = {
+        {gql_connection_manager::HANDSHAKE, true, false, true, 30,
+         "query{ handshake { api_version } }"},
+        {gql_connection_manager::REGISTER, false, false, false, 30,
+         "mutation($username: String!, $email: String!) {register(username: $username email: $email) {id, username token}}"},
+        {gql_connection_manager::LOGIN, false, false, true, 30,
+         "mutation($username: String!, $token: String!) {login(username: $username token: $token) {id username token}}"},
+        {gql_connection_manager::LOGOUT, true, true, false, 30,
+         "mutation {logout}"},
+        {gql_connection_manager::ALL_PLATFORMS, true, true, true, 30,
+         "query{ allPlatforms { id name description } }"},
+        {gql_connection_manager::ALL_DOCKER_IMAGES, true, true, true, 30,
+         "query($platformName: String!) { allDockerImages(platformName: $platformName) { id name platform{name} } }"},
+        {gql_connection_manager::ALL_SESSIONS, true, true, true, 30,
+         "query($platformName: String!, $state: [String!]!) { allSessions(platformName: $platformName state: $state) { id name state createdAt } }"},
+        {gql_connection_manager::ALL_JOBS, true, true, true, 30,
+         "query($platformName: String!, $sessionName: String!) { allJobs(platformName: $platformName sessionName: $sessionName) { id name } }"},
+        {gql_connection_manager::SUBS_DATA, true, true, true, 0,
+         "subscription{ subsData {message} }"},
+        {gql_connection_manager::SESSION_CREATE, true, true, false, 30,
+         "mutation($platform: String!, $name: String!, $type: String!, $dockerimage: String!, "
+                  "$maxJobs: Int!, $datasetSplit: Int!, $command: String!) "
+         "{ sessionCreate (platform: $platform name: $name type: $type dockerimage: $dockerimage "
+                          "maxJobs: $maxJobs datasetSplit: $datasetSplit command: $command) "
+         "{ name, id, user{username}, dockerImage{name} } }"},
+        {gql_connection_manager::SESSION, true, true, true, 30,
+         "query($name: String!) { session (name: $name) { name, command } }"},
+        {gql_connection_manager::SESSION_UPDATE_STATE, true, true, false, 30,
+         "mutation($name: String!, $state: String!) { sessionUpdateState ( name: $name state: $state ) {id, name} }"},
+        {gql_connection_manager::SESSION_SAVE, true, true, false, 600,
+         "mutation($name: String!, $dockerimage: String!, $description: String!) "
+         "{ sessionSave ( name: $name dockerimage: $dockerimage description: $description) { status } }"},
+        {gql_connection_manager::SESSION_STATUS, true, true, true, 30,
+         "query($name: String!) { sessionStatus ( name: $name ) {jobs {id datasetChunk state} state} }"},
+        {gql_connection_manager::ADMIN_REQUEST, true, true, false, 30,
+         "mutation($command: String!, $data: String!) { adminRequest ( command: $command data: $data ) }"},
+        {gql_connection_manager::RSYNC_REQUEST, true, true, true, 30,
+         "query{ rsyncRequest }"},
+    };
+    static_assert(sizeof(gql_operations)/sizeof(gql_operations[0]) == gql_connection_manager::OPERATION_COUNT,
+                  "every gql operation must have a document");
+}
+
 gql_connection_manager::gql_connection_manager() 
  : m_msg_id(m_handshake_msg_id+1),
    m_should_stop(false)
 {
+    compile_operations();
+    set_authentication_data("");
+    // the handshake may be waited for before the connection is even open.
+    open_mailbox(m_handshake_msg_id, RESPONSE_CAPACITY);
+
     m_endpoint.set_access_channels(websocketpp::log::alevel::none);
     m_endpoint.set_error_channels(websocketpp::log::elevel::none);
 
@@ -67,41 +134,483 @@ gql_connection_manager::set_ext_on_fail_handler(ext_handler_type ext_on_fail)
 
 void 
 gql_connection_manager::start(const std::string& uri) 
+{
+    m_uri = uri;
+    connect();
+    // start the ASIO io_service run loop
+    m_endpoint.run();
+}
+
+void 
+gql_connection_manager::connect() 
 {
     websocketpp::lib::error_code ec;
-    m_connection = m_endpoint.get_connection(uri, ec);
+    client::connection_ptr con = m_endpoint.get_connection(m_uri, ec);
     
     if (ec) {
         m_endpoint.get_alog().write(websocketpp::log::alevel::app,ec.message());
         return;
     }
-    m_connection->add_subprotocol("graphql-ws");
-    m_endpoint.connect(m_connection);
-    // start the ASIO io_service run loop
-    m_endpoint.run();
+    con->add_subprotocol("graphql-ws");
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        m_connection = con;
+    }
+    m_endpoint.connect(con);
+}
+
+bool
+gql_connection_manager::schedule_reconnect() 
+{
+    if(m_state == CLOSED || m_reconnect_attempt >= MAX_RECONNECT_ATTEMPTS) {
+        return false;
+    }
+    // exponential backoff with jitter, so that the clients dropped by the 
+    // same network event don't come back at the same time.
+    long delay = std::min(RECONNECT_MAX_DELAY_MS, RECONNECT_BASE_DELAY_MS << m_reconnect_attempt);
+    delay = std::uniform_int_distribution<long>(delay / 2, delay)(m_random);
+    ++m_reconnect_attempt;
+    PLOGW << "[gql] connection lost, reconnecting in " << delay << " ms (attempt " 
+          << m_reconnect_attempt << " of " << MAX_RECONNECT_ATTEMPTS << ")";
+    m_endpoint.set_timer(delay, [this](const websocketpp::lib::error_code& ec) {
+        if(!ec && m_state != CLOSED) {
+            connect();
+        }
+    });
+    return true;
 }
 
 void
 gql_connection_manager::stop_waiting_for_response()
 {
+    // called from the signal handler, where notifying a condition variable
+    // isn't safe. The waiters check the flag every STOP_CHECK_PERIOD.
     m_should_stop = true;
 }
 
 void
 gql_connection_manager::stop()
 {
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        m_state = CLOSED;
+    }
     m_should_stop = true;
+    m_message_cv.notify_all();
     m_endpoint.stop();
 }
 
+int 
+gql_connection_manager::register_operation()
+{
+    int id = m_msg_id++;
+    open_mailbox(id, RESPONSE_CAPACITY);
+    return id;
+}
+
+void 
+gql_connection_manager::open_mailbox(int msg_id, size_t capacity, 
+                                     const std::set<std::string>& event_types)
+{
+    auto mb = std::make_shared<mailbox>(capacity, event_types);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_mailboxes[msg_id] = std::move(mb);
+}
+
+void 
+gql_connection_manager::close_mailbox(int msg_id)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_mailboxes.erase(msg_id);
+}
+
+namespace
+{
+    // SAX handler picking up only the routing fields of a graphql-ws message:
+    // the top-level 'id' and 'type' and, for the data stream, the raw 
+    // 'payload.data.subsData.message' string. No DOM is built.
+    class envelope_reader
+    {
+    public:
+        bool has_id = false;
+        int id = -1;
+        std::string type;
+        std::string event;
+
+        bool null() { return value(); }
+        bool boolean(bool) { return value(); }
+        bool number_integer(json::number_integer_t v) { return number(v); }
+        bool number_unsigned(json::number_unsigned_t v) { return number(v); }
+        bool number_float(json::number_float_t, const std::string&) { return value(); }
+        bool string(std::string& v)
+        {
+            if(m_field == TYPE) {
+                type = std::move(v);
+            } else 
+            if(m_on_path && m_matched == EVENT_PATH_LENGTH - 1) {
+                event = std::move(v);
+            }
+            return value();
+        }
+        template<typename B>
+        bool binary(B&) { return value(); }
+        bool start_object(std::size_t)
+        {
+            if(m_on_path) {
+                ++m_matched;
+            }
+            value();
+            ++m_depth;
+            return true;
+        }
+        bool end_object()
+        {
+            --m_depth;
+            if(m_matched > 0 && m_matched == m_depth) {
+                --m_matched;
+            }
+            return true;
+        }
+        bool start_array(std::size_t)
+        {
+            value();
+            ++m_depth;
+            return true;
+        }
+        bool end_array()
+        {
+            --m_depth;
+            return true;
+        }
+        bool key(std::string& k)
+        {
+            m_field = m_depth != 1 ? OTHER : k == "id" ? ID : k == "type" ? TYPE : OTHER;
+            m_on_path = (m_matched == m_depth - 1 && 
+                         m_matched < EVENT_PATH_LENGTH && 
+                         k == EVENT_PATH[m_matched]);
+            return true;
+        }
+        template<typename E>
+        bool parse_error(std::size_t, const std::string&, const E&) { return false; }
+
+    private:
+        enum field { OTHER, ID, TYPE };
+        static constexpr int EVENT_PATH_LENGTH = 4;
+        static constexpr const char* EVENT_PATH[EVENT_PATH_LENGTH] = {"payload", "data", "subsData", "message"};
+
+        template<typename N>
+        bool number(N v)
+        {
+            if(m_field == ID) {
+                has_id = true;
+                id = static_cast<int>(v);
+            }
+            return value();
+        }
+        bool value()
+        {
+            m_field = OTHER;
+            m_on_path = false;
+            return true;
+        }
+
+        int m_depth = 0;
+        int m_matched = 0;
+        field m_field = OTHER;
+        bool m_on_path = false;
+    };
+
+    // SAX handler that stops as soon as the top-level 'type' of a data 
+    // stream event is found.
+    class event_type_reader
+    {
+    public:
+        std::string type;
+
+        bool null() { return value(); }
+        bool boolean(bool) { return value(); }
+        bool number_integer(json::number_integer_t) { return value(); }
+        bool number_unsigned(json::number_unsigned_t) { return value(); }
+        bool number_float(json::number_float_t, const std::string&) { return value(); }
+        bool string(std::string& v)
+        {
+            if(m_type_key) {
+                type = std::move(v);
+                return false;
+            }
+            return value();
+        }
+        template<typename B>
+        bool binary(B&) { return value(); }
+        bool start_object(std::size_t) { ++m_depth; return value(); }
+        bool end_object() { --m_depth; return true; }
+        bool start_array(std::size_t) { ++m_depth; return value(); }
+        bool end_array() { --m_depth; return true; }
+        bool key(std::string& k)
+        {
+            m_type_key = (m_depth == 1 && k == "type");
+            return true;
+        }
+        template<typename E>
+        bool parse_error(std::size_t, const std::string&, const E&) { return false; }
+
+    private:
+        bool value()
+        {
+            m_type_key = false;
+            return true;
+        }
+
+        int m_depth = 0;
+        bool m_type_key = false;
+    };
+}
+
+static std::string
+data_stream_event_type(const std::string& event)
+{
+    event_type_reader reader;
+    json::sax_parse(event, &reader);
+    return reader.type;
+}
+
+static json
+decode_message(int msg_id, const gql_connection_manager::payload_ptr& payload)
+{
+    // the router has already validated the payload, listeners get their own
+    // id in place of the one of the shared subscription.
+    json msg = json::parse(*payload, nullptr, false);
+    msg["id"] = msg_id;
+    return msg;
+}
+
+json
+gql_connection_manager::data_stream_event(const json& data_msg)
+{
+    const json* node = &data_msg;
+    for(const char* key : {"payload", "data", "subsData", "message"}) {
+        if(!node->is_object()) {
+            return json();
+        }
+        auto fit = node->find(key);
+        if(fit == node->end()) {
+            return json();
+        }
+        node = &*fit;
+    }
+    if(!node->is_string()) {
+        return json();
+    }
+    json event = json::parse(node->get_ref<const std::string&>(), nullptr, false);
+    if(event.is_discarded() || !event.is_object()) {
+        return json();
+    }
+    // progress events carry yet another JSON document as a string.
+    auto fit = event.find("data");
+    if(fit != event.end() && fit->is_string()) {
+        json data = json::parse(fit->get_ref<const std::string&>(), nullptr, false);
+        if(!data.is_discarded() && data.is_structured()) {
+            *fit = std::move(data);
+        }
+    }
+    return event;
+}
+
+void 
+gql_connection_manager::enqueue(int msg_id, mailbox& mb, const payload_ptr& payload, bool expendable)
+{
+    // producer side, runs on the network thread.
+    if(expendable && mb.in_reserve(MAILBOX_RESERVE)) {
+        // the consumer will catch up with a later progress event.
+        if(m_queue_dropped++ == 0) {
+            PLOGW << "[gql] mailbox for operation " << msg_id << " is almost full, dropping progress";
+        }
+        return;
+    }
+    if(!mb.messages.push(std::make_pair(m_arrival_seq++, payload))) {
+        // nobody is reading this stream, the messages that don't fit are lost.
+        ++m_queue_dropped;
+        if(mb.messages.overflows() == 1) {
+            PLOGW << "[gql] mailbox for operation " << msg_id << " is full, dropping new messages";
+        }
+        return;
+    }
+    size_t depth = mb.messages.size();
+    size_t high_water = m_queue_high_water.load(std::memory_order_relaxed);
+    while(depth > high_water && 
+          !m_queue_high_water.compare_exchange_weak(high_water, depth, std::memory_order_relaxed)) {
+    }
+}
+
 void 
-gql_connection_manager::pull_incoming_messages(std::list<json>& messages)
+gql_connection_manager::fulfil_promise(int msg_id, mailbox& mb)
 {
-    messages.clear();
-    if(m_mutex.try_lock()) {
-        m_incoming_messages.swap(messages);
-        m_mutex.unlock();
+    // called with m_mutex locked, somebody waits on a future so the 
+    // message is handed over directly.
+    std::pair<uint64_t, payload_ptr> item;
+    if(!mb.promise || !mb.messages.pop(item)) {
+        return;
+    }
+    mb.promise->set_value(std::make_pair(RESPONSE, decode_message(msg_id, item.second)));
+    mb.promise.reset();
+    mb.has_promise = false;
+    if(mb.completed && mb.messages.empty()) {
+        m_mailboxes.erase(msg_id);
+    }
+}
+
+void 
+gql_connection_manager::wake_waiters()
+{
+    // pairs with the fence in the waiters: either they see the new messages
+    // or we see them registered and go through m_mutex, so that the 
+    // notification can't slip in between their check and their wait.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_waiters.load() == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+    }
+    m_message_cv.notify_all();
+}
+
+static json
+error_response(int id, const std::string& message)
+{
+    return {
+        {"id", id},
+        {"type", gql_consts::DATA},
+        {"payload", {
+            {"data", nullptr},
+            {"errors", {{{"message", message}}}}
+            }
+        },
+    };
+}
+
+void 
+gql_connection_manager::finish_operation(int msg_id, bool error, const payload_ptr& payload)
+{
+    // called with m_mutex locked for 'complete' and 'error' messages, they 
+    // end the operation so the mailboxes may go away here.
+    if(msg_id == m_data_stream_id) {
+        m_data_stream_id = -1;
+        for(int listener_id : m_data_stream_listeners) {
+            auto fit = m_mailboxes.find(listener_id);
+            if(fit == m_mailboxes.end()) {
+                continue;
+            }
+            mailbox& mb = *fit->second;
+            if(error) {
+                enqueue(listener_id, mb, payload);
+            }
+            mb.completed = true;
+            if(!mb.messages.empty()) {
+                fulfil_promise(listener_id, mb);
+            } else
+            if(mb.promise) {
+                mb.promise->set_value(std::make_pair(INTERRUPTED, json()));
+                mb.promise.reset();
+                mb.has_promise = false;
+            }
+        }
+        // the listeners wait out what is left in their mailboxes, a new
+        // subscription starts over with the listeners it gets.
+        m_data_stream_listeners.clear();
+        return;
+    }
+    auto fit = m_mailboxes.find(msg_id);
+    if(fit == m_mailboxes.end() || fit->second->timed_out) {
+        return;
+    }
+    mailbox& mb = *fit->second;
+    mb.completed = true;
+    if(error) {
+        enqueue(msg_id, mb, payload);
+        fulfil_promise(msg_id, mb);
+        return;
+    }
+    // the operation is over, drop the mailbox once its content is consumed.
+    if(mb.messages.empty()) {
+        if(mb.promise) {
+            mb.promise->set_value(std::make_pair(INTERRUPTED, json()));
+        }
+        m_mailboxes.erase(fit);
+    }
+}
+
+void 
+gql_connection_manager::route_message(payload_ptr payload)
+{
+    // only the envelope is decoded here, the consumers parse the payload.
+    envelope_reader envelope;
+    if(!json::sax_parse(*payload, &envelope)) {
+        PLOGE << "[gql] dropping malformed message";
+        return;
+    }
+    // connection_ack, keep-alives, etc. don't belong to any operation.
+    if(!envelope.has_id) {
+        return;
+    }
+    const int msg_id = envelope.id;
+    const bool error = (envelope.type == gql_consts::ERROR);
+    const bool terminal = (error || envelope.type == gql_consts::COMPLETE);
+    forget_operation(msg_id, terminal);
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if(terminal) {
+            finish_operation(msg_id, error, payload);
+        } else 
+        if(msg_id == m_data_stream_id) {
+            for(int listener_id : m_data_stream_listeners) {
+                auto fit = m_mailboxes.find(listener_id);
+                if(fit != m_mailboxes.end()) {
+                    m_route_targets.emplace_back(listener_id, fit->second);
+                }
+            }
+        } else {
+            auto fit = m_mailboxes.find(msg_id);
+            if(fit != m_mailboxes.end() && !fit->second->timed_out) {
+                m_route_targets.emplace_back(msg_id, fit->second);
+            }
+        }
     }
+
+    // the lookup is all that needs the lock, the rings take the messages 
+    // without it.
+    std::string event_type;
+    bool event_type_known = false;
+    bool has_promise = false;
+    auto type_of_event = [&]() -> const std::string& {
+        if(!event_type_known) {
+            event_type = data_stream_event_type(envelope.event);
+            event_type_known = true;
+        }
+        return event_type;
+    };
+    for(auto& target : m_route_targets) {
+        mailbox& mb = *target.second;
+        if(!mb.event_types.empty() && mb.event_types.count(type_of_event()) == 0) {
+            continue;
+        }
+        // the event is only looked at once the mailbox is down to its reserve.
+        bool expendable = !envelope.event.empty() && mb.in_reserve(MAILBOX_RESERVE) &&
+                          PROGRESS_EVENT_TYPES.count(type_of_event()) != 0;
+        enqueue(target.first, mb, payload, expendable);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for(auto& target : m_route_targets) {
+        has_promise = has_promise || target.second->has_promise;
+    }
+    if(has_promise) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for(auto& target : m_route_targets) {
+            fulfil_promise(target.first, *target.second);
+        }
+    }
+    m_route_targets.clear();
+    wake_waiters();
 }
 
 void 
@@ -133,6 +642,11 @@ gql_connection_manager::on_fail(websocketpp::connection_hdl hdl)
 {
     client::connection_ptr con = m_endpoint.get_con_from_hdl(hdl);
 
+    // the very first connection attempt fails straight away, the subsequent 
+    // ones keep retrying until the backoff budget is exhausted.
+    if(m_was_open && schedule_reconnect()) {
+        return;
+    }
     if(ext_on_fail_cb) {
         ext_on_fail_cb(con->get_local_close_reason());
     }
@@ -141,21 +655,63 @@ gql_connection_manager::on_fail(websocketpp::connection_hdl hdl)
 void 
 gql_connection_manager::on_open(websocketpp::connection_hdl hdl) 
 {
-    init_connection();
+    bool reconnected = m_was_open;
+    m_was_open = true;
+    m_reconnect_attempt = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        m_state = OPEN;
+    }
+    if(reconnected) {
+        PLOGI << "[gql] connection re-established";
+        // nobody waits for this handshake, the server only needs it to set 
+        // up the connection before the in-flight operations are re-issued.
+        send_operation(HANDSHAKE, nullptr, m_handshake_msg_id);
+        replay_operations();
+    } else {
+        init_connection();
+    }
 }
 
 void 
 gql_connection_manager::on_message(websocketpp::connection_hdl hdl, message_ptr msg) 
 {
-    json jmsg = json::parse(msg->get_payload());
-    //std::cout<<"msg: "<<jmsg.dump(4)<<std::endl;
-    std::lock_guard<std::mutex> guard(m_mutex);
-    m_incoming_messages.push_back(std::move(jmsg));
+    route_message(std::make_shared<const std::string>(std::move(msg->get_raw_payload())));
 }
 
 void 
 gql_connection_manager::on_close(websocketpp::connection_hdl) 
 {
+    std::vector<int> failed_ids;
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        if(m_state == CLOSED) {
+            return;
+        }
+        m_state = RECONNECTING;
+        // whatever was sent and isn't safe to repeat has an unknown outcome now.
+        for(auto it = m_in_flight.begin(); it != m_in_flight.end(); ) {
+            if(it->second.sent && !gql_operations[it->second.op].idempotent) {
+                failed_ids.push_back(it->first);
+                it = m_in_flight.erase(it);
+            } else {
+                it->second.sent = false;
+                ++it;
+            }
+        }
+    }
+    for(int id : failed_ids) {
+        route_message(std::make_shared<const std::string>(
+            error_response(id, "connection to the server was lost, the request may not have completed.").dump()));
+    }
+
+    if(schedule_reconnect()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        m_state = CLOSED;
+    }
     if(ext_on_close_cb) {
         ext_on_close_cb("");
     }
@@ -170,25 +726,194 @@ gql_connection_manager::init_connection()
 void 
 gql_connection_manager::set_authentication_data(const std::string& token)
 {
+    std::lock_guard<std::mutex> guard(m_send_mutex);
     m_token = token;
+    m_authorization = "\"authorization\":" + json(m_token.empty() ? "" : "Bearer " + m_token).dump() + ",";
+}
+
+void
+gql_connection_manager::compile_operations()
+{
+    for(const auto& op : gql_operations) {
+        // everything but the authorization, the variables and the id is 
+        // known upfront, the request only appends these to the prefix.
+        json payload = {
+            {"extensions", nullptr},
+            {"operationName", nullptr},
+            {"query", op.document}
+        };
+        if(op.with_endpoint) {
+            payload["endpoint"] = "cli";
+        }
+        std::string payload_str = payload.dump();
+        payload_str.pop_back();
+        m_operation_prefixes[op.op] = "{\"type\":\"start\",\"payload\":" + payload_str + ",";
+    }
+    m_send_buffer.reserve(SEND_BUFFER_SIZE);
+}
+
+void
+gql_connection_manager::send_operation(operation op, const nlohmann::json& variables, int id)
+{
+    std::lock_guard<std::mutex> guard(m_send_mutex);
+    pending_operation& pending = m_in_flight[id];
+    pending.op = op;
+    pending.variables = variables.is_null() ? "{}" : variables.dump();
+    pending.sent = false;
+    if(gql_operations[op].deadline_s) {
+        schedule_deadline(id, std::chrono::seconds(gql_operations[op].deadline_s));
+    }
+    if(m_state != OPEN) {
+        // goes out as soon as the connection is (re-)established.
+        return;
+    }
+    send_pending(id, pending);
+}
+
+void
+gql_connection_manager::send_pending(int id, pending_operation& pending)
+{
+    // called with m_send_mutex locked.
+    m_send_buffer.assign(m_operation_prefixes[pending.op]);
+    if(gql_operations[pending.op].with_authorization) {
+        m_send_buffer.append(m_authorization);
+    }
+    m_send_buffer.append("\"variables\":");
+    m_send_buffer.append(pending.variables);
+    m_send_buffer.append("},\"id\":");
+    m_send_buffer.append(std::to_string(id));
+    m_send_buffer.push_back('}');
+    websocketpp::lib::error_code ec = m_connection->send(m_send_buffer, websocketpp::frame::opcode::text);
+    pending.sent = !ec;
+}
+
+void
+gql_connection_manager::replay_operations()
+{
+    std::lock_guard<std::mutex> guard(m_send_mutex);
+    // std::map keeps the original issue order.
+    for(auto& pending : m_in_flight) {
+        if(!pending.second.sent) {
+            send_pending(pending.first, pending.second);
+        }
+    }
+}
+
+void
+gql_connection_manager::forget_operation(int id, bool completed)
+{
+    std::lock_guard<std::mutex> guard(m_send_mutex);
+    auto fit = m_in_flight.find(id);
+    if(fit == m_in_flight.end()) {
+        return;
+    }
+    // queries and mutations are answered by a single result, subscriptions 
+    // live until they are completed or stopped.
+    if(completed || fit->second.op != SUBS_DATA) {
+        m_in_flight.erase(fit);
+        m_deadlines.cancel(id);
+    }
+}
+
+void
+gql_connection_manager::schedule_deadline(int id, std::chrono::milliseconds timeout)
+{
+    // the timer wheel is owned by the asio thread.
+    size_t ticks = (timeout + DEADLINE_TICK - std::chrono::milliseconds(1)) / DEADLINE_TICK;
+    auto schedule = [this, id, ticks]() {
+        m_deadlines.schedule(id, ticks);
+        if(!m_deadline_timer_armed) {
+            m_deadline_timer_armed = true;
+            m_endpoint.set_timer(DEADLINE_TICK.count(), 
+                                 bind(&type::on_deadline_tick, this, _1));
+        }
+    };
+#if BOOST_VERSION < 106600
+    m_endpoint.get_io_service().post(schedule);
+#else
+    boost::asio::post(m_endpoint.get_io_service(), schedule);
+#endif
+}
+
+void
+gql_connection_manager::on_deadline_tick(const websocketpp::lib::error_code& ec)
+{
+    m_deadline_timer_armed = false;
+    if(ec || m_state == CLOSED) {
+        return;
+    }
+    for(int id : m_deadlines.advance()) {
+        expire_operation(id);
+    }
+    // the timer only runs while there are deadlines to watch.
+    if(!m_deadlines.empty()) {
+        m_deadline_timer_armed = true;
+        m_endpoint.set_timer(DEADLINE_TICK.count(), 
+                             bind(&type::on_deadline_tick, this, _1));
+    }
+}
+
+void
+gql_connection_manager::expire_operation(int id)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_send_mutex);
+        if(m_in_flight.erase(id) == 0) {
+            // answered in the meantime.
+            return;
+        }
+    }
+    PLOGW << "[gql] operation " << id << " timed out";
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto fit = m_mailboxes.find(id);
+        if(fit == m_mailboxes.end()) {
+            return;
+        }
+        mailbox& mb = *fit->second;
+        if(mb.promise) {
+            mb.promise->set_value(std::make_pair(TIMED_OUT, error_response(id, "request timed out.")));
+            m_mailboxes.erase(fit);
+            return;
+        }
+        // keep a tombstone so the waiter can tell the timeout apart, the 
+        // late response (if any) is dropped by the router.
+        mb.timed_out = true;
+        std::pair<uint64_t, payload_ptr> item;
+        while(mb.messages.pop(item)) {
+        }
+    }
+    wake_waiters();
+}
+
+void
+gql_connection_manager::send_stop(int id)
+{
+    std::lock_guard<std::mutex> guard(m_send_mutex);
+    m_in_flight.erase(id);
+    if(m_state != OPEN) {
+        return;
+    }
+    json stop_msg = {
+        {"id", id},
+        {"type", gql_consts::STOP},
+    };
+    m_connection->send(stop_msg.dump(), websocketpp::frame::opcode::text);
 }
 
 void 
 gql_connection_manager::send_handshake()
 {
-    json handshake_msg = {
-        {"id", m_handshake_msg_id},
-        {"type", "start"},
-        {"payload", {
-            {"endpoint", "cli"},            
-            {"variables" , {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", "query{ handshake { api_version } }"}
-            }
-        },
-    };
-    m_connection->send(handshake_msg.dump(), websocketpp::frame::opcode::text);
+    bool open = false;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        open = m_mailboxes.count(m_handshake_msg_id) != 0;
+    }
+    // normally opened by the constructor already, and maybe waited on.
+    if(!open) {
+        open_mailbox(m_handshake_msg_id, RESPONSE_CAPACITY);
+    }
+    send_operation(HANDSHAKE, nullptr, m_handshake_msg_id);
 }    
 
 
@@ -207,117 +932,40 @@ gql_connection_manager::wait_for_handshake()
 int 
 gql_connection_manager::register_user(const std::string& username, const std::string& email)
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "mutation {register(username: \""
-        << username
-        << "\" email: \""
-        << email
-        << "\") {id, username token}}";
-    json register_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {
-            {"variables" , {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(register_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(REGISTER, {{"username", username}, {"email", email}}, id);
     return id;
 }
 
 int 
 gql_connection_manager::login(const std::string& username, const std::string& token)
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "mutation {login(username: \""
-        << username
-        << "\" token: \""
-        << token
-        << "\") {id username token}}";
-    json login_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {
-            {"variables" , {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(login_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(LOGIN, {{"username", username}, {"token", token}}, id);
     return id;
 }
 
 int 
 gql_connection_manager::logout()
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "mutation {logout}";
-    json logout_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token},  
-            {"endpoint", "cli"},
-            {"variables" , {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(logout_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(LOGOUT, nullptr, id);
     return id;
 }
 
 int
 gql_connection_manager::query_platforms() 
 {
-    int id = m_msg_id++;
-    json allplatforms_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", "query{ allPlatforms { id name description } }"}
-            }
-        },
-    };
-    m_connection->send(allplatforms_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(ALL_PLATFORMS, nullptr, id);
     return id;
 }
 
 int
 gql_connection_manager::query_docker_images(const std::string& platform) 
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "query{ allDockerImages(platformName: \""<< platform <<"\") { id name platform{name} } }";
-    json alldockerimages_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(alldockerimages_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(ALL_DOCKER_IMAGES, {{"platformName", platform}}, id);
     return id;
 }
 
@@ -325,78 +973,54 @@ int
 gql_connection_manager::query_sessions(const std::string& platform, 
                                        const std::vector<std::string>& statuses) 
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "query{ allSessions(platformName: \""<< platform <<"\" "
-       << "state: [ ";
-    for(const auto& s : statuses) {
-        ss << "\"" << s << "\", ";
-    }   
-    ss << "]) { id name state createdAt } }";
-    json allsessions_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(allsessions_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(ALL_SESSIONS, {{"platformName", platform}, {"state", statuses}}, id);
     return id;
 }
 
 int
 gql_connection_manager::query_jobs(const std::string& platform, const std::string& session) 
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "query{ allJobs(platformName: \""<< platform <<"\" ";
-    ss << "sessionName: \""<< session <<"\")";
-    ss << " { id name } }";
-    json alljobs_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(alljobs_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(ALL_JOBS, {{"platformName", platform}, {"sessionName", session}}, id);
     return id;
 }
 
 
 int
-gql_connection_manager::subscribe_to_data_stream()
+gql_connection_manager::subscribe_to_data_stream(const std::set<std::string>& event_types)
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "subscription{ subsData {message} }";
-    json allplatforms_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(allplatforms_msg.dump(), websocketpp::frame::opcode::text);
-    return id;    
+    int listener_id = m_msg_id++;
+    open_mailbox(listener_id, MAILBOX_CAPACITY, event_types);
+    int id = -1;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_data_stream_listeners.insert(listener_id);
+        if(m_data_stream_id != -1) {
+            return listener_id;
+        }
+        id = m_data_stream_id = m_msg_id++;
+    }
+    send_operation(SUBS_DATA, nullptr, id);
+    return listener_id;    
+}
+
+void
+gql_connection_manager::unsubscribe_from_data_stream(int listener_id)
+{
+    int id = -1;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_mailboxes.erase(listener_id);
+        if(m_data_stream_listeners.erase(listener_id) == 0 || 
+           !m_data_stream_listeners.empty() ||
+           m_data_stream_id == -1) {
+            return;
+        }
+        std::swap(id, m_data_stream_id);
+    }
+    // the last listener is gone, stop the server-side subscription.
+    send_stop(id);
 }
 
 int 
@@ -408,91 +1032,38 @@ gql_connection_manager::session_start(const std::string& name,
                                       int max_jobs,
                                       int dataset_split)
 {
-    int id = m_msg_id++;
+    int id = register_operation();
 
     std::istringstream iss(command);
     json command_js;
     std::copy(std::istream_iterator<std::string>(iss),
                std::istream_iterator<std::string>(), std::back_inserter(command_js));
 
-    std::stringstream ss;
-    ss << "mutation{ sessionCreate (";
-    ss << " platform: \"" << platform << "\"";
-    ss << " name: \"" << name << "\"";
-    ss << " type: \"" << type << "\"";
-    ss << " dockerimage: \"" << docker_image << "\"";
-    ss << " maxJobs: " << max_jobs;
-    ss << " datasetSplit: " << dataset_split;
-    ss << " command: " << std::quoted(command_js.dump());
-    ss << ")";    
-    ss << " { name, id, user{username}, dockerImage{name} } }";
-    json sstart_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(sstart_msg.dump(), websocketpp::frame::opcode::text);
+    send_operation(SESSION_CREATE, 
+                   {{"platform", platform},
+                    {"name", name},
+                    {"type", type},
+                    {"dockerimage", docker_image},
+                    {"maxJobs", max_jobs},
+                    {"datasetSplit", dataset_split},
+                    {"command", command_js.dump()}}, 
+                   id);
     return id;
 }
 
 int 
 gql_connection_manager::session_join(const std::string& name)
 {
-    int id = m_msg_id++;
-    std::stringstream ss;
-    ss << "query{ session (";
-    ss << " name: \"" << name << "\"";
-    ss << ")";    
-    ss << " { name, command } }";
-    json sstart_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-
-    m_connection->send(sstart_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(SESSION, {{"name", name}}, id);
     return id;
 }
 
 int 
 gql_connection_manager::session_stop(const std::string& name, bool cancel)
 {
-    int id = m_msg_id++;
-
-    std::stringstream ss;
-    ss << "mutation{ sessionUpdateState ( name: \"" << name << "\" state: \"" 
-       << (cancel ? "CANCELED" : "COMPLETED") << "\" ) {id, name} }";
-    
-    json sstop_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(sstop_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(SESSION_UPDATE_STATE, {{"name", name}, {"state", cancel ? "CANCELED" : "COMPLETED"}}, id);
     return id;
 }
 
@@ -501,169 +1072,194 @@ gql_connection_manager::session_save(const std::string& name,
                                      const std::string& dockerimage, 
                                      const std::string& comment)
 {
-    int id = m_msg_id++;
-
-    std::stringstream ss;
-
-    ss << "mutation{ sessionSave (";
-    ss << " name: \"" << name << "\"";
-    ss << " dockerimage: \"" << dockerimage << "\"";
-    ss << " description: \"" << comment << "\")";
-        ss << " { status } }";
-    
-    json ssave_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(ssave_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(SESSION_SAVE, {{"name", name}, {"dockerimage", dockerimage}, {"description", comment}}, id);
     return id;
 }
 
 int 
 gql_connection_manager::session_status(const std::string& name)
 {
-    int id = m_msg_id++;
-
-    std::stringstream ss;
-    ss << "query { sessionStatus ( name: \"" << name << "\" ) {jobs {id datasetChunk state} state} }";
-    
-    json sstop_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(sstop_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(SESSION_STATUS, {{"name", name}}, id);
     return id;
 }
 
 int 
 gql_connection_manager::admin_diagnostics()
 {
-    int id = m_msg_id++;
-
-    std::stringstream ss;
-
-    ss << "mutation{ adminRequest (";
-    ss << " command: \"DIAGNOSTICS\"";
-    ss << " data: \"\")}";
-    
-    json ssave_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", ss.str()}
-            }
-        },
-    };
-    m_connection->send(ssave_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(ADMIN_REQUEST, {{"command", "DIAGNOSTICS"}, {"data", ""}}, id);
     return id;
 }
 
 int
 gql_connection_manager::sync_request() 
 {
-    int id = m_msg_id++;
-    json rsync_request_msg = {
-        {"id", id},
-        {"type", "start"},
-        {"payload", {            
-            {"authorization", m_token.empty() ? "" : "Bearer " + m_token}, 
-            {"endpoint", "cli"},            
-            {"variables", {}},
-            {"extensions", {}},
-            {"operationName", {}},
-            {"query", "query{ rsyncRequest }"}
-            }
-        },
-    };
-    m_connection->send(rsync_request_msg.dump(), websocketpp::frame::opcode::text);
+    int id = register_operation();
+    send_operation(RSYNC_REQUEST, nullptr, id);
     return id;
 }
 
-std::pair<bool, nlohmann::json> 
+std::future<gql_connection_manager::response_type>
+gql_connection_manager::async_response(int msg_id)
+{
+    std::promise<response_type> promise;
+    auto future = promise.get_future();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto fit = m_mailboxes.find(msg_id);
+    if(fit == m_mailboxes.end()) {
+        // unknown or already completed operation, nothing will ever arrive.
+        promise.set_value(std::make_pair(INTERRUPTED, nlohmann::json()));
+        return future;
+    }
+    mailbox& mb = *fit->second;
+    if(mb.timed_out) {
+        m_mailboxes.erase(fit);
+        promise.set_value(std::make_pair(TIMED_OUT, error_response(msg_id, "request timed out.")));
+        return future;
+    }
+    // announce the promise before looking into the ring, a message pushed 
+    // concurrently is then either seen here or handed over by the producer.
+    mb.promise = std::make_unique<std::promise<response_type>>(std::move(promise));
+    mb.has_promise = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    fulfil_promise(msg_id, mb);
+    if(mb.promise && mb.completed && mb.messages.empty()) {
+        // e.g. the data stream ended, nothing will ever arrive.
+        mb.promise->set_value(std::make_pair(INTERRUPTED, nlohmann::json()));
+        m_mailboxes.erase(fit);
+    }
+    return future;
+}
+
+gql_connection_manager::response_type
+gql_connection_manager::wait_for_future(std::future<response_type>& response)
+{
+    m_should_stop = false;
+    while(response.wait_for(STOP_CHECK_PERIOD) != std::future_status::ready) {
+        if(m_should_stop) {
+            m_should_stop = false;
+            return std::make_pair(INTERRUPTED, nlohmann::json());
+        }
+    }
+    return response.get();
+}
+
+gql_connection_manager::response_type 
 gql_connection_manager::wait_for_response(int msg_id)
 {
     m_should_stop = false;
-    nlohmann::json response;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_waiters;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    response_type response = std::make_pair(INTERRUPTED, nlohmann::json());
     while(true) {
+        auto fit = m_mailboxes.find(msg_id);
+        if(fit == m_mailboxes.end()) {
+            // unknown or already completed operation, nothing will ever arrive.
+            break;
+        }
+        mailbox& mb = *fit->second;
+        if(mb.timed_out) {
+            m_mailboxes.erase(fit);
+            response = std::make_pair(TIMED_OUT, error_response(msg_id, "request timed out."));
+            break;
+        }
+        std::pair<uint64_t, payload_ptr> item;
+        if(mb.messages.pop(item)) {
+            if(mb.completed && mb.messages.empty()) {
+                m_mailboxes.erase(fit);
+            }
+            response = std::make_pair(RESPONSE, decode_message(msg_id, item.second));
+            break;
+        }
+        if(mb.completed && mb.messages.empty()) {
+            // e.g. the data stream ended, nothing will ever arrive.
+            m_mailboxes.erase(fit);
+            break;
+        }
         if(m_should_stop) {
-            m_should_stop = false;
-            return std::make_pair(true, nlohmann::json()) ;
-        }
-        std::list<nlohmann::json> incoming_messages;
-        pull_incoming_messages(incoming_messages);
-        if(!incoming_messages.empty()) {
-            for(auto msg : incoming_messages) {
-                //std::cout<<"msg "<<msg.dump(4)<<std::endl;
-                if(msg["id"] == msg_id) {                    
-                    return std::make_pair(false, msg) ;
-                }
-            }                       
+            break;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        m_message_cv.wait_for(lock, STOP_CHECK_PERIOD);
     }
-    // Note: it should never get here...
-    return std::make_pair(false, nlohmann::json()) ;
+    --m_waiters;
+    if(response.first == INTERRUPTED) {
+        m_should_stop = false;
+    }
+    return response;
 }
 
-std::pair<bool, std::list<nlohmann::json>> 
+std::pair<gql_connection_manager::response_status, std::list<nlohmann::json>> 
 gql_connection_manager::wait_for_response(const std::set<int>& msg_ids)
 {
     m_should_stop = false;
-    std::list<nlohmann::json> responses;
+    std::vector<std::pair<uint64_t, nlohmann::json>> responses;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_waiters;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int timed_out = -1;
     while(true) {
-        
-        if(m_should_stop) {
-            m_should_stop = false;
-            return std::make_pair(true, std::list<nlohmann::json>({nlohmann::json()}));
-        }
-
-        std::list<nlohmann::json> incoming_messages;
-        pull_incoming_messages(incoming_messages);
-        if(!incoming_messages.empty()) {
-            for(auto msg : incoming_messages) {
-                // skip 'command' messages, those are gql service layer.
-                //if(msg["type"] != "data") {
-                //    continue;
-                //}
-                //std::cout<<"XMSG "<<msg.dump(4)<<std::endl;
-                if(msg["id"] != nullptr && msg_ids.count(msg["id"].get<int>())) {
-                    responses.push_back(msg);
-                }
-            }                       
+        bool any_open = false;
+        for(int msg_id : msg_ids) {
+            auto fit = m_mailboxes.find(msg_id);
+            if(fit == m_mailboxes.end()) {
+                continue;
+            }
+            mailbox& mb = *fit->second;
+            if(mb.timed_out) {
+                // reported once the responses popped in this pass are out,
+                // the mailbox stays until then.
+                timed_out = msg_id;
+                continue;
+            }
+            any_open = true;
+            std::pair<uint64_t, payload_ptr> item;
+            while(mb.messages.pop(item)) {
+                responses.emplace_back(item.first, decode_message(msg_id, item.second));
+            }
+            if(mb.completed && mb.messages.empty()) {
+                m_mailboxes.erase(fit);
+            }
         }
-        if(responses.empty()) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        } else {
+        if(timed_out != -1 && responses.empty()) {
+            m_mailboxes.erase(timed_out);
+            --m_waiters;
+            return std::make_pair(TIMED_OUT, std::list<nlohmann::json>({error_response(timed_out, "request timed out.")}));
+        }
+        if(!responses.empty()) {
+            --m_waiters;
+            std::sort(responses.begin(), responses.end(), 
+                      [](const auto& a, const auto& b) { return a.first < b.first; });
+            std::list<nlohmann::json> ordered;
+            for(auto& r : responses) {
+                ordered.push_back(std::move(r.second));
+            }
+            return std::make_pair(RESPONSE, std::move(ordered));
+        }
+        if(!any_open || m_should_stop) {
             break;
         }
+        m_message_cv.wait_for(lock, STOP_CHECK_PERIOD);
     }
-    // Note: it should never get here...
-    return std::make_pair(false, responses);
+    --m_waiters;
+    m_should_stop = false;
+    return std::make_pair(INTERRUPTED, std::list<nlohmann::json>({nlohmann::json()}));
 }
 
+gql_connection_manager::queue_stats
+gql_connection_manager::get_queue_stats()
+{
+    queue_stats stats;
+    stats.high_water = m_queue_high_water;
+    stats.dropped = m_queue_dropped;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for(const auto& mb : m_mailboxes) {
+        stats.depth += mb.second->messages.size();
+    }
+    return stats;
+}
 
 } // namespace metriffic
 
@@ -5,7 +5,19 @@
 #include <websocketpp/client.hpp>
 #include <nlohmann/json.hpp>
 #include <set>
+#include <map>
+#include <random>
+#include <array>
 #include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include "timer_wheel.hpp"
+#include "spsc_ring.hpp"
 
 namespace metriffic
 {
@@ -24,10 +36,54 @@ public:
     typedef client::connection_ptr connection_ptr;
     typedef std::function<void(const std::string& msg)> ext_handler_type;
 
+    // operations supported by the client, their documents are compiled once 
+    // and requests only carry the variables.
+    enum operation 
+    {
+        HANDSHAKE,
+        REGISTER,
+        LOGIN,
+        LOGOUT,
+        ALL_PLATFORMS,
+        ALL_DOCKER_IMAGES,
+        ALL_SESSIONS,
+        ALL_JOBS,
+        SUBS_DATA,
+        SESSION_CREATE,
+        SESSION,
+        SESSION_UPDATE_STATE,
+        SESSION_SAVE,
+        SESSION_STATUS,
+        ADMIN_REQUEST,
+        RSYNC_REQUEST,
+        OPERATION_COUNT
+    };
+
+    // outcome of waiting for a response, RESPONSE is 0 so it tests false.
+    enum response_status
+    {
+        RESPONSE = 0,
+        INTERRUPTED,
+        TIMED_OUT
+    };
+    typedef std::pair<response_status, nlohmann::json> response_type;
+
+    // raw text of a server message, shared by all the mailboxes it's routed to.
+    typedef std::shared_ptr<const std::string> payload_ptr;
+
+    // occupancy of the mailboxes, depth is the number of messages not yet 
+    // consumed, high_water the deepest a single mailbox has been and dropped 
+    // the number of messages rejected by full mailboxes.
+    struct queue_stats
+    {
+        size_t depth = 0;
+        size_t high_water = 0;
+        size_t dropped = 0;
+    };
+
     gql_connection_manager();
     void start(const std::string& uri);
     void stop();
-    void pull_incoming_messages(std::list<nlohmann::json>& messages);
 
     void on_socket_init(websocketpp::connection_hdl);
 #ifndef TEST_MODE
@@ -42,7 +98,59 @@ public:
     void set_ext_on_fail_handler(ext_handler_type ext_on_fail);
 
 private:
+    // per-operation queue of the messages received from the server, the 
+    // messages are tagged with the arrival sequence number so the responses 
+    // pulled from several mailboxes at once can be returned in arrival order.
+    // Messages are kept undecoded, the consumer parses what it pops.
+    // The network thread is the only producer and pushes without m_mutex, 
+    // the consumer side (pop, promise, flags) is serialized by m_mutex.
+    struct mailbox 
+    {
+        mailbox(size_t capacity, const std::set<std::string>& types)
+         : messages(capacity),
+           event_types(types)
+        {}
+        spsc_ring<std::pair<uint64_t, payload_ptr>> messages;
+        // data stream listeners only, empty accepts every event type.
+        const std::set<std::string> event_types;
+        std::atomic<bool> completed{false};
+        std::atomic<bool> timed_out{false};
+        std::atomic<bool> has_promise{false};
+        std::unique_ptr<std::promise<response_type>> promise;
+        // down to the slots kept for the messages that aren't progress.
+        bool in_reserve(size_t reserve) const { return messages.size() + reserve >= messages.capacity(); }
+    };
+    typedef std::shared_ptr<mailbox> mailbox_ptr;
+
+    struct pending_operation
+    {
+        operation op;
+        std::string variables;
+        bool sent = false;
+    };
+
     void init_connection();    
+    void connect();
+    bool schedule_reconnect();
+    void compile_operations();
+    void send_operation(operation op, const nlohmann::json& variables, int id);
+    void send_pending(int id, pending_operation& pending);
+    void replay_operations();
+    void forget_operation(int id, bool completed);
+    void send_stop(int id);
+    void schedule_deadline(int id, std::chrono::milliseconds timeout);
+    void on_deadline_tick(const websocketpp::lib::error_code& ec);
+    void expire_operation(int id);
+
+    int register_operation();
+    void open_mailbox(int msg_id, size_t capacity, 
+                      const std::set<std::string>& event_types = {});
+    void close_mailbox(int msg_id);
+    void route_message(payload_ptr payload);
+    void finish_operation(int msg_id, bool error, const payload_ptr& payload);
+    void enqueue(int msg_id, mailbox& mb, const payload_ptr& payload, bool expendable = false);
+    void fulfil_promise(int msg_id, mailbox& mb);
+    void wake_waiters();
 
 public:
     void send_handshake();
@@ -75,30 +183,127 @@ public:
     int admin_diagnostics();
 
     int sync_request();
-    int subscribe_to_data_stream();
+
+    // attaches a listener to the shared 'subsData' subscription, the returned 
+    // id is local to the client and receives the data stream messages of the 
+    // given types (all of them if empty).
+    int subscribe_to_data_stream(const std::set<std::string>& event_types = {});
+    void unsubscribe_from_data_stream(int listener_id);
+    // decodes the event carried by a data stream message together with its 
+    // JSON-encoded 'data' field, null if the message carries no event.
+    static nlohmann::json data_stream_event(const nlohmann::json& data_msg);
 
     void stop_waiting_for_response();
-    std::pair<bool, nlohmann::json> wait_for_response(int msg_id);
-    std::pair<bool, std::list<nlohmann::json>> wait_for_response(const std::set<int>& msg_ids);
+    // a timed out operation is reported with TIMED_OUT and a GraphQL error 
+    // response, so callers that only look at the payload still report it.
+    response_type wait_for_response(int msg_id);
+    std::pair<response_status, std::list<nlohmann::json>> wait_for_response(const std::set<int>& msg_ids);
+
+    // non-blocking flavor: the future is fulfilled on the network thread as 
+    // soon as the response arrives, so several requests can be in flight 
+    // at once. wait_for_future() waits for it and honors ctrl-c.
+    std::future<response_type> async_response(int msg_id);
+    response_type wait_for_future(std::future<response_type>& response);
+
+    queue_stats get_queue_stats();
 
 private:
     ext_handler_type ext_on_close_cb;
     ext_handler_type ext_on_fail_cb;
 
 private:
+    enum connection_state
+    {
+        CONNECTING,
+        OPEN,
+        RECONNECTING,
+        CLOSED
+    };
+
     client m_endpoint;
     client::connection_ptr m_connection;
+    std::string     m_uri;
+    std::atomic<connection_state> m_state{CONNECTING};
+    bool            m_was_open = false;
+    int             m_reconnect_attempt = 0;
+    std::mt19937    m_random{std::random_device()()};
+    const int       MAX_RECONNECT_ATTEMPTS = 10;
+    const long      RECONNECT_BASE_DELAY_MS = 500;
+    const long      RECONNECT_MAX_DELAY_MS = 30000;
+
+    // operations that are sent (or waiting for the connection) and not 
+    // answered yet, re-issued under the same ids after a reconnect.
+    std::map<int, pending_operation> m_in_flight;
+
+    // deadlines of the in-flight operations, only touched on the asio thread.
+    timer_wheel     m_deadlines{DEADLINE_SLOTS};
+    bool            m_deadline_timer_armed = false;
+    static constexpr size_t DEADLINE_SLOTS = 512;
+    static constexpr std::chrono::milliseconds DEADLINE_TICK{250};
     
     std::string     m_token;
+    std::string     m_authorization;
+
+    std::array<std::string, OPERATION_COUNT> m_operation_prefixes;
+    std::mutex      m_send_mutex;
+    std::string     m_send_buffer;
+    const size_t    SEND_BUFFER_SIZE = 4096;
 
     std::mutex      m_mutex;
+    std::condition_variable m_message_cv;
+    // number of threads blocked on m_message_cv, the producer only takes 
+    // m_mutex to wake them up when there are any.
+    std::atomic<int> m_waiters{0};
 
     const int       m_handshake_msg_id = 0;
-    int             m_msg_id;
-    
-    std::list<nlohmann::json> m_incoming_messages;
+    std::atomic<int> m_msg_id;
+
+    std::unordered_map<int, mailbox_ptr> m_mailboxes;
+    // producer-side state, only touched on the network thread.
+    uint64_t        m_arrival_seq = 0;
+    std::vector<std::pair<int, mailbox_ptr>> m_route_targets;
+
+    std::atomic<size_t> m_queue_high_water{0};
+    std::atomic<size_t> m_queue_dropped{0};
 
-    bool m_should_stop;
+    // the single server-side 'subsData' subscription shared by all listeners.
+    int             m_data_stream_id = -1;
+    std::set<int>   m_data_stream_listeners;
+    const size_t    RESPONSE_CAPACITY = 16;
+    const size_t    MAILBOX_CAPACITY = 1024;
+    // the last slots of a mailbox don't take progress events, so that the
+    // event ending a pull or push still gets in when nobody keeps up.
+    const size_t    MAILBOX_RESERVE = 64;
+    const std::set<std::string> PROGRESS_EVENT_TYPES = {"pull_data", "push_data"};
+
+    std::atomic<bool> m_should_stop;
+
+    // upper bound for a waiter to notice stop_waiting_for_response(), which is
+    // called from the signal handler and therefore can't lock m_mutex.
+    const std::chrono::milliseconds STOP_CHECK_PERIOD = std::chrono::milliseconds(500);
+};
+
+// keeps a data stream listener attached for the lifetime of the object.
+class data_stream_subscription
+{
+public:
+    data_stream_subscription(gql_connection_manager& gql, 
+                             const std::set<std::string>& event_types = {})
+     : m_gql(gql),
+       m_id(gql.subscribe_to_data_stream(event_types))
+    {}
+    ~data_stream_subscription()
+    {
+        m_gql.unsubscribe_from_data_stream(m_id);
+    }
+    data_stream_subscription(const data_stream_subscription&) = delete;
+    data_stream_subscription& operator=(const data_stream_subscription&) = delete;
+
+    int id() const { return m_id; }
+
+private:
+    gql_connection_manager& m_gql;
+    const int m_id;
 };
 
 } // namespace metriffic
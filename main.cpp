@@ -4,35 +4,41 @@
 #include <cxxopts.hpp>
 #include <plog/Log.h>
 #include <plog/Initializers/RollingFileInitializer.h>
+#include <unistd.h>
+#include <memory>
+#include <filesystem>
 
 #include "session_commands.hpp"
 #include "authentication_commands.hpp"
 #include "query_commands.hpp"
 #include "workspace_commands.hpp"
 #include "admin_commands.hpp"
+#include "tunnel_commands.hpp"
 //#include "test_commands.hpp"
 #include "app_context.hpp"
 #include "utils.hpp"
 
 using namespace cli;
 
-metriffic::app_context context;
+// constructed once it's known not to be a proxy run, the terminal session
+// takes over stdin/stdout.
+std::unique_ptr<metriffic::app_context> context;
 
 void sigint_callback_handler(int signum) 
 {
-    if(context.session.RunningCommand()) {    
-        context.session.RunningCommand()->Cancel(context.session);
-        context.session.CancelRunningCommand();
-        context.gql_manager.stop_waiting_for_response(); 
+    if(context->session.RunningCommand()) {    
+        context->session.RunningCommand()->Cancel(context->session);
+        context->session.CancelRunningCommand();
+        context->gql_manager.stop_waiting_for_response(); 
     } else
-    if(context.session.CurrentMenu()->Parent()) {
-        context.session.SetCurrentMenu(context.session.CurrentMenu()->Parent());
-        context.session.OutStream()<<std::endl;
-        context.session.Prompt();
+    if(context->session.CurrentMenu()->Parent()) {
+        context->session.SetCurrentMenu(context->session.CurrentMenu()->Parent());
+        context->session.OutStream()<<std::endl;
+        context->session.Prompt();
     } else {
-        context.session.OutStream()<<"\nuse exit to quit..."<<std::endl;
-        context.session.reset_input();
-        context.session.Prompt();   
+        context->session.OutStream()<<"\nuse exit to quit..."<<std::endl;
+        context->session.reset_input();
+        context->session.Prompt();   
     }             
 }
 
@@ -42,20 +48,20 @@ void sigpipe_callback_handler(int signum)
 
 void validate_handshake()
 {
-    auto handshake = context.gql_manager.wait_for_handshake();
+    auto handshake = context->gql_manager.wait_for_handshake();
    
     const auto server_api_version = handshake["api_version"].is_null() ? "unknown" : handshake["api_version"].get<std::string>();
-    if(server_api_version == "unknown" || context.api_version != semver::version(server_api_version)) {
-        std::cout<<"\rsupported API version ("<<context.api_version.to_string()<<") doesn't match the version of the back-end ("
+    if(server_api_version == "unknown" || context->api_version != semver::version(server_api_version)) {
+        std::cout<<"\rsupported API version ("<<context->api_version.to_string()<<") doesn't match the version of the back-end ("
                  <<server_api_version<<"), please update the tool..."<<std::endl;
-        context.session.Exit();        
+        context->session.Exit();        
     }
 }
 
 void process_command_line(int argc, char** argv)
 {
     try {
-        cxxopts::Options options(argv[0], " - command line options");
+        cxxopts::Options options(argv[0], " - command line options, or 'proxy <target> -u <user>' to run as ssh ProxyCommand");
         options.add_options()
             ("v,version", "Print version information and exit.")
             ("g,generate-keys", "Generate pairs of keys for user authentication.", cxxopts::value<std::string>())
@@ -73,18 +79,18 @@ void process_command_line(int argc, char** argv)
         }
 
         if (result.count("version")) {
-            std::cout << "\rcli tool:    " << context.version << std::endl;
-            // std::cout << "\rbackend-end: "<< context.api_version << std::endl;
+            std::cout << "\rcli tool:    " << context->version << std::endl;
+            // std::cout << "\rbackend-end: "<< context->api_version << std::endl;
             exit(0);
         }
         if (result.count("generate-keys")) {
             const std::string username = result["generate-keys"].as<std::string>();
             bool status = true;
             std::string error = "";
-            std::tie(status, error) = context.settings.generate_keys(username);
+            std::tie(status, error) = context->settings.generate_keys(username);
             std::cout << "successfully generated bastion and user keys for username "<< username << ":" << std::endl;
-            std::cout << "   bastion keys: " << context.settings.bastion_key_file(username)<<"{.pub}"<<std::endl;
-            std::cout << "   user keys: " << context.settings.user_key_file(username)<<"{.pub}"<<std::endl;
+            std::cout << "   bastion keys: " << context->settings.bastion_key_file(username)<<"{.pub}"<<std::endl;
+            std::cout << "   user keys: " << context->settings.user_key_file(username)<<"{.pub}"<<std::endl;
             exit(0);
         }
     } 
@@ -94,6 +100,69 @@ void process_command_line(int argc, char** argv)
     }
 }
 
+int run_proxy(int argc, char** argv)
+{
+    // ssh talks to the proxy over stdin/stdout, the errors go to stderr.
+    try {
+        cxxopts::Options options("metriffic proxy", " - forward stdin/stdout to the container of a session, made for ssh's ProxyCommand");
+        options.add_options()
+            ("target", "name of the interactive session, or 'rsync' for the workspace sync server", cxxopts::value<std::string>())
+            ("u,user", "metriffic username", cxxopts::value<std::string>())
+            ("h,help", "Print usage");
+        options.parse_positional({"target"});
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help")) {
+            std::cerr << options.help() << std::endl;
+            return 0;
+        }
+        if (result.count("target") != 1 || result.count("user") != 1) {
+            std::cerr << "proxy: '<target>' and '-u|--user' are mandatory arguments." << std::endl;
+            return 1;
+        }
+        const std::string target = result["target"].as<std::string>();
+        const std::string username = result["user"].as<std::string>();
+
+        metriffic::settings_manager settings;
+        const std::string key_file = settings.bastion_key_file(username);
+        metriffic::ssh_manager ssh;
+        int in_fd = dup(STDIN_FILENO);
+        int out_fd = dup(STDOUT_FILENO);
+        // no logger in this mode, ssh shows what goes to stderr.
+        std::string error;
+        if(target == metriffic::app_context::RSYNC_PROXY_TARGET) {
+            error = ssh.run_rsync_proxy(username, key_file, in_fd, out_fd);
+            if(!error.empty()) {
+                std::cerr << "proxy: " << error << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+        bool found = false;
+        std::string host;
+        unsigned int port = 0;
+        std::tie(found, host, port) = settings.proxy_target(username, target);
+        if(!found) {
+            std::cerr << "proxy: no container is known for session '" << target 
+                      << "' of user '" << username << "', start or join it first." << std::endl;
+            close(in_fd);
+            close(out_fd);
+            return 1;
+        }
+        error = ssh.run_stdio_proxy(username, key_file, host, port, 
+                                    metriffic::ssh_manager::INTERACTIVE, in_fd, out_fd);
+        if(!error.empty()) {
+            std::cerr << "proxy: " << error << std::endl;
+            return 1;
+        }
+        return 0;
+    } 
+    catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << "proxy: error parsing options: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
 void setup_logger() 
 {
     struct log_formatter
@@ -114,9 +183,9 @@ void setup_logger()
             return ss.str();
         }
     };
-    std::string log_file =  context.settings.log_file();
-    std::string token = context.token;
-    context.gql_manager.set_authentication_data(token);
+    std::string log_file =  context->settings.log_file();
+    std::string token = context->token;
+    context->gql_manager.set_authentication_data(token);
 
     plog::init<log_formatter>(plog::verbose, log_file.c_str(), 1000000, 2); 
 
@@ -126,9 +195,19 @@ void setup_logger()
 
 int main(int argc, char** argv)
 {
-    signal(SIGINT, sigint_callback_handler);
     signal(SIGPIPE, sigpipe_callback_handler);
 
+    if(argc > 1 && std::string(argv[1]) == "proxy") {
+        return run_proxy(argc - 1, argv + 1);
+    }
+
+    context = std::make_unique<metriffic::app_context>();
+    // a bare name is looked up in PATH by the shell running the ProxyCommand.
+    const std::string program = argv[0];
+    context->program = program.find('/') == std::string::npos ? 
+                       program : std::filesystem::absolute(program).string();
+    signal(SIGINT, sigint_callback_handler);
+
     process_command_line(argc, argv);
 
 #ifdef TEST_MODE
@@ -136,13 +215,13 @@ int main(int argc, char** argv)
 #else
     const std::string URI = "wss://api.metriffic.com/graphql";
 #endif
-    context.start_communication(URI);
-    context.session.ExitAction(
+    context->start_communication(URI);
+    context->session.ExitAction(
         [](auto& out) // session exit action
         {
-            context.gql_manager.stop();
-            context.session.disable_input();
-            context.ios.stop();
+            context->gql_manager.stop();
+            context->session.disable_input();
+            context->ios.stop();
         }
     );
 
@@ -150,7 +229,7 @@ int main(int argc, char** argv)
 
     setup_logger();
 
-    context.cli.RootMenu() -> Insert(
+    context->cli.RootMenu() -> Insert(
         create_cmd_helper(
             "message_stream",
             [](std::ostream& out, int argc, char** argv){ 
@@ -158,18 +237,27 @@ int main(int argc, char** argv)
                 options.add_options()
                     ("v,verbose", "Verbose output", cxxopts::value<bool>()->default_value("false"));
                 auto result = options.parse(argc, argv);
+                bool verbose = result["verbose"].as<bool>();
 
-                int msg_id = context.gql_manager.subscribe_to_data_stream();
+                metriffic::data_stream_subscription sbs(context->gql_manager);
                 while(true) {
-                    auto response = context.gql_manager.wait_for_response(msg_id);
+                    auto response = context->gql_manager.wait_for_response(sbs.id());
+                    if(response.first) {
+                        out<<"interrupted..."<<std::endl;
+                        break;
+                    }
                     nlohmann::json data_msg = response.second;
                     out<<data_msg.dump(4)<<std::endl;
+                    if(verbose) {
+                        auto stats = context->gql_manager.get_queue_stats();
+                        out<<"queue depth: "<<stats.depth
+                           <<", high-water: "<<stats.high_water
+                           <<", dropped: "<<stats.dropped<<std::endl;
+                    }
                     if(data_msg["payload"]["data"] != nullptr) {
                         out<<data_msg["payload"]["data"]["subsData"]["message"].get<std::string>()<<std::endl;
-                    } else 
-                    if(response.first) {
-                        out<<"data stream error..."<<std::endl;
                     } else {
+                        out<<"data stream error..."<<std::endl;
                         break;
                     }
                 }
@@ -179,33 +267,36 @@ int main(int argc, char** argv)
             {})
     );
 
-    metriffic::authentication_commands auth_cmds(context);
-    context.cli.RootMenu() -> Insert(auth_cmds.create_login_cmd());
-    context.cli.RootMenu() -> Insert(auth_cmds.create_logout_cmd());
+    metriffic::authentication_commands auth_cmds(*context);
+    context->cli.RootMenu() -> Insert(auth_cmds.create_login_cmd());
+    context->cli.RootMenu() -> Insert(auth_cmds.create_logout_cmd());
+
+    metriffic::query_commands query_cmds(*context);
+    context->cli.RootMenu() -> Insert(query_cmds.create_show_cmd());
 
-    metriffic::query_commands query_cmds(context);
-    context.cli.RootMenu() -> Insert(query_cmds.create_show_cmd());
+    metriffic::session_commands session_cmds(*context);
+    context->cli.RootMenu() -> Insert(session_cmds.create_interactive_cmd());
+    context->cli.RootMenu() -> Insert(session_cmds.create_batch_cmd());
 
-    metriffic::session_commands session_cmds(context);
-    context.cli.RootMenu() -> Insert(session_cmds.create_interactive_cmd());
-    context.cli.RootMenu() -> Insert(session_cmds.create_batch_cmd());
+    metriffic::workspace_commands workspace_cmds(*context);
+    context->cli.RootMenu() -> Insert(workspace_cmds.create_sync_cmd());
 
-    metriffic::workspace_commands workspace_cmds(context);
-    context.cli.RootMenu() -> Insert(workspace_cmds.create_sync_cmd());
+    metriffic::tunnel_commands tunnel_cmds(*context);
+    context->cli.RootMenu() -> Insert(tunnel_cmds.create_tunnels_cmd());
 
-    metriffic::admin_commands admin_cmds(context);
-    context.cli.RootMenu() -> Insert(admin_cmds.create_admin_cmd());
+    metriffic::admin_commands admin_cmds(*context);
+    context->cli.RootMenu() -> Insert(admin_cmds.create_admin_cmd());
 
 #if BOOST_VERSION < 106600
-    boost::asio::io_service::work work(context.ios);
+    boost::asio::io_service::work work(context->ios);
 #else
-    auto work = boost::asio::make_work_guard(context.ios);
+    auto work = boost::asio::make_work_guard(context->ios);
 #endif    
 
-    //metriffic::test_commands test_cmds(context);
-    //context.cli.RootMenu() -> Insert(test_cmds.create_test_cmd());
+    //metriffic::test_commands test_cmds(*context);
+    //context->cli.RootMenu() -> Insert(test_cmds.create_test_cmd());
 
-    context.ios.run();
+    context->ios.run();
 
     return 0;
 }
@@ -0,0 +1,104 @@
+#include "progress_coalescer.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace metriffic
+{
+
+progress_coalescer::progress_coalescer(std::ostream& out, const std::string& what,
+                                       size_t phases, std::chrono::milliseconds tick)
+ : m_out(out),
+   m_what(what),
+   m_phases(std::max<size_t>(phases, 1)),
+   m_tick(tick),
+   m_start(clock::now())
+{}
+
+progress_coalescer::layer_state&
+progress_coalescer::layer(const std::string& id)
+{
+    auto& state = m_layers[id];
+    if(state.current.empty()) {
+        state.current.resize(m_phases, 0);
+    }
+    return state;
+}
+
+void
+progress_coalescer::update(const std::string& id, size_t phase, int64_t current, int64_t total)
+{
+    if(phase >= m_phases || total <= 0) {
+        return;
+    }
+    auto& state = layer(id);
+    if(state.total != total) {
+        // all the phases of a layer share its size.
+        m_total += int64_t(m_phases) * (total - state.total);
+        state.total = total;
+    }
+    current = std::min(std::max<int64_t>(current, 0), total);
+    m_done += current - state.current[phase];
+    state.current[phase] = current;
+    m_dirty = true;
+}
+
+void
+progress_coalescer::complete(const std::string& id, size_t phase)
+{
+    auto& state = layer(id);
+    if(phase >= m_phases || state.total == 0) {
+        return;
+    }
+    update(id, phase, state.total, state.total);
+}
+
+void
+progress_coalescer::render()
+{
+    if(!m_dirty) {
+        return;
+    }
+    auto now = clock::now();
+    if(m_rendered && now - m_last_render < m_tick) {
+        return;
+    }
+    m_last_render = now;
+    draw();
+}
+
+void
+progress_coalescer::finish()
+{
+    if(m_dirty) {
+        draw();
+    }
+    if(m_rendered) {
+        m_out << std::endl;
+        m_rendered = false;
+    }
+}
+
+void
+progress_coalescer::draw()
+{
+    float progress = m_total > 0 ? float(m_done) / float(m_total) : 0.0f;
+
+    // per phase byte rate, so it reads as the network throughput.
+    double elapsed = std::chrono::duration<double>(clock::now() - m_start).count();
+    double rate = elapsed > 0.0 ? double(m_done) / m_phases / elapsed : 0.0;
+    std::string details = "  " + format_bytes(rate) + "/s";
+    if(rate > 0.0 && m_done < m_total) {
+        long eta = long(double(m_total - m_done) / m_phases / rate);
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%02ld:%02ld", eta / 60, eta % 60);
+        details += std::string("  eta ") + buf;
+    }
+    print_progress_bar(m_out, m_what, progress, details);
+
+    m_dirty = false;
+    m_rendered = true;
+}
+
+} // namespace metriffic
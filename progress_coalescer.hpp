@@ -0,0 +1,62 @@
+#ifndef PROGRESS_COALESCER_HPP
+#define PROGRESS_COALESCER_HPP
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <ostream>
+
+namespace metriffic
+{
+
+// merges the per-layer progress events of a docker pull/push into a single
+// progress line. Each layer goes through a fixed number of phases (e.g.
+// download and extract) of the same size, updates only record the state and
+// the line is re-rendered at most once per tick.
+class progress_coalescer
+{
+public:
+    progress_coalescer(std::ostream& out, const std::string& what, size_t phases = 1,
+                       std::chrono::milliseconds tick = std::chrono::milliseconds(250));
+
+    void update(const std::string& layer, size_t phase, int64_t current, int64_t total);
+    // the phase is over, the server doesn't report the final byte count.
+    void complete(const std::string& layer, size_t phase);
+
+    // renders the aggregate if anything changed and the tick has elapsed.
+    void render();
+    // renders the final state and ends the line, if anything was rendered.
+    void finish();
+
+private:
+    struct layer_state
+    {
+        int64_t total = 0;
+        std::vector<int64_t> current;
+    };
+
+    layer_state& layer(const std::string& id);
+    void draw();
+
+private:
+    std::ostream& m_out;
+    const std::string m_what;
+    const size_t m_phases;
+    const std::chrono::milliseconds m_tick;
+
+    std::unordered_map<std::string, layer_state> m_layers;
+    int64_t m_done = 0;
+    int64_t m_total = 0;
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point m_start;
+    clock::time_point m_last_render;
+    bool m_dirty = false;
+    bool m_rendered = false;
+};
+
+} // namespace metriffic
+
+#endif //PROGRESS_COALESCER_HPP
@@ -24,8 +24,12 @@ query_commands::show_platforms(std::ostream& out)
 {
     int msg_id = m_context.gql_manager.query_platforms();
     auto response = m_context.gql_manager.wait_for_response(msg_id);
-    nlohmann::json show_msg = response.second;
+    print_platforms(out, response.second);
+}
 
+void
+query_commands::print_platforms(std::ostream& out, nlohmann::json& show_msg)
+{
     if(show_msg["payload"]["data"] != nullptr) {
         for (auto& s : show_msg["payload"]["data"]["allPlatforms"]) {
 
@@ -43,8 +47,13 @@ query_commands::show_docker_images(std::ostream& out, const std::string& platfor
 {
     int msg_id = m_context.gql_manager.query_docker_images(platform);
     auto response = m_context.gql_manager.wait_for_response(msg_id);
-    nlohmann::json show_msg = response.second;
-    //std::cout<<response.second.dump(4)<<std::endl;
+    print_docker_images(out, response.second);
+}
+
+void
+query_commands::print_docker_images(std::ostream& out, nlohmann::json& show_msg)
+{
+    //std::cout<<show_msg.dump(4)<<std::endl;
     if(show_msg["payload"]["data"] != nullptr) {
         std::map<std::string, std::list<std::string>> platform_images;
         for(auto& s : show_msg["payload"]["data"]["allDockerImages"]) {
@@ -81,7 +90,12 @@ query_commands::show_sessions(std::ostream& out,
 {
     int msg_id = m_context.gql_manager.query_sessions(platform, statuses);
     auto response = m_context.gql_manager.wait_for_response(msg_id);
-    nlohmann::json show_msg = response.second;
+    print_sessions(out, response.second);
+}
+
+void
+query_commands::print_sessions(std::ostream& out, nlohmann::json& show_msg)
+{
     if(show_msg["payload"]["data"] != nullptr) {
         for (auto& s : show_msg["payload"]["data"]["allSessions"]) {
             out << "  name: " << s["name"].get<std::string>() 
@@ -95,6 +109,37 @@ query_commands::show_sessions(std::ostream& out,
     }
 }
 
+void
+query_commands::show_all(std::ostream& out, const std::string& platform)
+{
+    auto& gql = m_context.gql_manager;
+    // fire all the queries at once, the total wait is the slowest of them.
+    auto platforms = gql.async_response(gql.query_platforms());
+    auto docker_images = gql.async_response(gql.query_docker_images(platform));
+    auto sessions = gql.async_response(gql.query_sessions(platform, {}));
+
+    auto platforms_response = gql.wait_for_future(platforms);
+    if(platforms_response.first == gql_connection_manager::INTERRUPTED) {
+        return;
+    }
+    out << "platforms:" << std::endl;
+    print_platforms(out, platforms_response.second);
+
+    auto docker_images_response = gql.wait_for_future(docker_images);
+    if(docker_images_response.first == gql_connection_manager::INTERRUPTED) {
+        return;
+    }
+    out << "docker-images:" << std::endl;
+    print_docker_images(out, docker_images_response.second);
+
+    auto sessions_response = gql.wait_for_future(sessions);
+    if(sessions_response.first == gql_connection_manager::INTERRUPTED) {
+        return;
+    }
+    out << "sessions:" << std::endl;
+    print_sessions(out, sessions_response.second);
+}
+
 /*void
 query_commands::show_jobs(std::ostream& out, const std::string& platform, const std::string& session)
 {
@@ -131,7 +176,7 @@ query_commands::create_show_cmd()
                 
 
                 if(result.count("items") != 1) {
-                    out << CMD_SHOW_NAME << ": 'items' (either 'platforms' or 'docker-images') "
+                    out << CMD_SHOW_NAME << ": 'items' (either 'platforms', 'docker-images', 'sessions' or 'all') "
                         << "is a mandatory argument." << std::endl;
                     return;
                 }
@@ -169,6 +214,9 @@ query_commands::create_show_cmd()
                 } else 
                 if(items == "sessions") {
                     show_sessions(out, platform, filter);
+                } else 
+                if(items == "all") {
+                    show_all(out, platform);
                 // } else 
                 // if(items == "jobs") {
                 //     std::string platform;
@@ -176,7 +224,7 @@ query_commands::create_show_cmd()
                 //     show_jobs(out, platform, session);
                 } else {
                     out << CMD_SHOW_NAME << ": unsupported item type, "
-                        << "supported types are: 'platforms' or 'docker-images'." << std::endl;
+                        << "supported types are: 'platforms', 'docker-images', 'sessions' or 'all'." << std::endl;
                     return;
                 }
             } catch (std::exception& e) {
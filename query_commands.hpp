@@ -22,6 +22,11 @@ private:
     void show_sessions(std::ostream& out, 
                        const std::string& platform, 
                        const std::vector<std::string>& statuses);
+    void show_all(std::ostream& out, const std::string& platform);
+
+    void print_platforms(std::ostream& out, nlohmann::json& msg);
+    void print_docker_images(std::ostream& out, nlohmann::json& msg);
+    void print_sessions(std::ostream& out, nlohmann::json& msg);
     // void show_jobs(std::ostream& out, 
     //                const std::string& platform, 
     //                const std::string& session);
@@ -31,7 +36,7 @@ private:
     const std::string CMD_SHOW_NAME = "show";
     const std::string CMD_SHOW_HELP = "Query supported platforms and docker-images";
     const std::vector<std::string> CMD_SHOW_PARAMDESC = {
-        {"<items>: mandatory argument, the type of data to show. Can be either 'platforms' or 'docker-images'"},
+        {"<items>: mandatory argument, the type of data to show. Can be either 'platforms', 'docker-images', 'sessions' or 'all'"},
         {"-p|--platform <name of the platform>: platform selector, can be used when querying docker-images"},
         {"-s|--session <name of the session>: session selector, can be used when querying jobs."},
         {"-f|--filter <filter in json format>: Used for sessions, format: {state:SUBMITTED|RUNNING|CANCELED|COMPLETED}."}
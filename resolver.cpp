@@ -0,0 +1,78 @@
+#include "resolver.hpp"
+
+#include <plog/Log.h>
+#include <netdb.h>
+#include <cstring>
+#include <algorithm>
+
+namespace metriffic
+{
+
+resolver::resolver(std::chrono::seconds ttl)
+ : m_ttl(ttl)
+{}
+
+std::string
+resolver::key_of(const std::string& host, unsigned int port)
+{
+    return host + ":" + std::to_string(port);
+}
+
+std::vector<resolver::address>
+resolver::resolve(const std::string& host, unsigned int port)
+{
+    const std::string key = key_of(host, port);
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto fit = m_entries.find(key);
+        if(fit != m_entries.end() && now < fit->second.expires) {
+            return fit->second.addresses;
+        }
+    }
+
+    // the lookup runs unlocked, concurrent misses of a host resolve it
+    // twice rather than waiting for each other.
+    struct addrinfo hints = {}, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_ADDRCONFIG;
+    const std::string service = std::to_string(port);
+    int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs);
+    if(err != 0) {
+        PLOGE << "[resolver] error: failed to get address of " << host << ": " << gai_strerror(err);
+        return {};
+    }
+    std::vector<address> preferred, others;
+    for(struct addrinfo* ai = addrs; ai != NULL; ai = ai->ai_next) {
+        address a = {};
+        std::memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        a.len = ai->ai_addrlen;
+        a.family = ai->ai_family;
+        (preferred.empty() || preferred.front().family == a.family ? preferred : others).push_back(a);
+    }
+    freeaddrinfo(addrs);
+
+    std::vector<address> addresses;
+    for(size_t i = 0; i < std::max(preferred.size(), others.size()); ++i) {
+        if(i < preferred.size()) {
+            addresses.push_back(preferred[i]);
+        }
+        if(i < others.size()) {
+            addresses.push_back(others[i]);
+        }
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_entries[key] = entry{addresses, now + m_ttl};
+    return addresses;
+}
+
+void
+resolver::invalidate(const std::string& host, unsigned int port)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_entries.erase(key_of(host, port));
+}
+
+} // namespace metriffic
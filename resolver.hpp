@@ -0,0 +1,52 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <sys/socket.h>
+
+namespace metriffic
+{
+
+// caches the addresses of the hosts connected to over and over, IPv4 and
+// IPv6 alike. getaddrinfo() doesn't tell the TTL of the records, entries
+// expire after a fixed time instead and can be dropped early when none
+// of their addresses works anymore. Thread safe.
+class resolver
+{
+public:
+    struct address
+    {
+        struct sockaddr_storage addr;
+        socklen_t len;
+        int family;
+    };
+
+    explicit resolver(std::chrono::seconds ttl = std::chrono::seconds(300));
+
+    // the addresses in the order to try them: the families interleaved,
+    // starting with the one getaddrinfo() prefers (RFC 8305). Empty if the
+    // lookup failed.
+    std::vector<address> resolve(const std::string& host, unsigned int port);
+    void invalidate(const std::string& host, unsigned int port);
+
+private:
+    struct entry
+    {
+        std::vector<address> addresses;
+        std::chrono::steady_clock::time_point expires;
+    };
+    static std::string key_of(const std::string& host, unsigned int port);
+
+private:
+    const std::chrono::seconds m_ttl;
+    std::mutex m_mutex;
+    std::map<std::string, entry> m_entries;
+};
+
+} // namespace metriffic
+
+#endif //RESOLVER_HPP
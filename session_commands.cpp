@@ -1,6 +1,7 @@
 #include "session_commands.hpp"
 #include "app_context.hpp"
 #include "utils.hpp"
+#include "progress_coalescer.hpp"
 
 #include <regex>
 #include <cli/cli.h>
@@ -13,25 +14,6 @@ namespace metriffic
 
 namespace tc = termcolor;
 
-void
-show_progress(std::ostream& out, const std::string& what, float progress)
-{
-    if(progress < 0.0) progress = 0.0;
-    if(progress > 1.0) progress = 1.0;
-
-    constexpr int BARWIDTH = 30;
-
-    std::cout << "\r\t" << what << " [";
-    int pos = BARWIDTH * progress;
-    for (int i = 0; i < BARWIDTH; ++i) {
-        if (i < pos) std::cout << "=";
-        else if (i == pos) out << ">";
-        else out << " ";
-    }
-    out << "] " << int(progress * 100.0) << " %";
-    out.flush();
-}
-
 session_commands::session_commands(app_context& c)
  : m_context(c)
 {}
@@ -72,7 +54,9 @@ session_commands::session_start_interactive(std::ostream& out,
                                             const std::string& platform)
 {
     const int MAX_JOBS = 1;    
-    int sbs_msg_id = m_context.gql_manager.subscribe_to_data_stream();
+    data_stream_subscription sbs(m_context.gql_manager, 
+                                 {"pull_data", "pull_success", "pull_error", "exec_success", "start_error"});
+    int sbs_msg_id = sbs.id();
     int msg_id = m_context.gql_manager.session_start(
                                 name,
                                 platform,
@@ -81,76 +65,76 @@ session_commands::session_start_interactive(std::ostream& out,
                                 "",
                                 MAX_JOBS,
                                 0);
+    // layers are downloaded and then extracted, both phases count.
+    progress_coalescer progress(out, "loading:", 2);
     bool in_progress = false;
 
     while(true) {
         auto response = m_context.gql_manager.wait_for_response({msg_id, sbs_msg_id});
 
         if(response.first) {
-            if(in_progress) {
-                out << std::endl;
-            }
-            out<< "interrupted..." << std::endl;
+            progress.finish();
+            out << (response.first == gql_connection_manager::TIMED_OUT ? "request timed out..." : "interrupted...") << std::endl;
             session_stop_interactive(out, name);
             break;
         }
 
         for(const auto& data_msg : response.second ) {
-            PLOGV << "session start response: " << data_msg.dump(4);
 
             if(!data_msg.contains("payload") || data_msg["payload"] == nullptr) {
                 continue;
             }
             if(data_msg["type"] == "error") {
+                progress.finish();
                 out << "datastream error (abnormal query?)..." << std::endl;
                 return;
             } else 
             if(data_msg["payload"].contains("errors")) {
+                progress.finish();
                 out << "error: "<<data_msg["payload"]["errors"][0]["message"].get<std::string>() << std::endl;
                 return;
             }
 
 
             if(data_msg["id"] == msg_id) {
+                PLOGV << "session start response: " << data_msg.dump(4);
                 out << "bringing up the requested ssh container, this may take a while..." << std::endl;
                 out << "note: ctrl-c will cancel the request..." << std::endl << std::endl;
             } else
             if(data_msg["id"] == sbs_msg_id) {
                 if(data_msg["payload"].contains("data")) {
-                    auto msg = nlohmann::json::parse(data_msg["payload"]["data"]["subsData"]["message"].get<std::string>());
+                    auto msg = gql_connection_manager::data_stream_event(data_msg);
 
                     if(msg.contains("type")) {
                         if(msg["type"] == "pull_data") {
-                            auto data = nlohmann::json::parse(msg["data"].get<std::string>());
-
-                            if(data["status"] == "Downloading") {
-                                if(in_progress == false) {
-                                    out << "loading docker image. " << std::endl;
-                                }
-                                in_progress = true;
-                                float done = data["progressDetail"]["current"].get<int>();
-                                float total = data["progressDetail"]["total"].get<int>();
-                                show_progress(out, "downloading:", done/total);
-                            }
-                            if(data["status"] == "Download complete") {
-                                show_progress(out, "downloading:", 1.0);
-                                out << std::endl; 
+                            // progress floods aren't logged, the coalescer renders 
+                            // them once per tick after the batch.
+                            auto& data = msg["data"];
+                            if(!data.is_object() || !data.contains("id") || !data["id"].is_string()) {
+                                continue;
                             }
+                            const std::string layer = data["id"].get<std::string>();
+                            const size_t phase = (data["status"] == "Downloading" || data["status"] == "Download complete") ? 0 : 1;
 
-                            if(data["status"] == "Extracting") {
+                            if(data["status"] == "Downloading" || data["status"] == "Extracting") {
                                 if(in_progress == false) {
                                     out << "loading docker image. " << std::endl;
+                                    in_progress = true;
                                 }
-                                float done = data["progressDetail"]["current"].get<int>();
-                                float total = data["progressDetail"]["total"].get<int>();
-                                show_progress(out, "extracting: ", done/total);
-                            }
-                            if(data["status"] == "Pull complete") {
-                                show_progress(out, "extracting: ", 1.0);
-                                out << std::endl; 
+                                auto& detail = data["progressDetail"];
+                                if(detail.contains("current") && detail.contains("total")) {
+                                    progress.update(layer, phase, detail["current"].get<int64_t>(), 
+                                                                  detail["total"].get<int64_t>());
+                                }
+                            } else
+                            if(data["status"] == "Download complete" || data["status"] == "Pull complete") {
+                                progress.complete(layer, phase);
                             }
+                            continue;
+                        }
 
-                        } else 
+                        PLOGV << "session start event: " << msg.dump(4);
+                        progress.finish();
                         if(msg["type"] == "pull_success") {
                             out << "docker image is ready. " << std::endl;                            
                         } else 
@@ -172,6 +156,7 @@ session_commands::session_start_interactive(std::ostream& out,
                                 out << "the container is ready, you can ssh to it by running:" << std::endl;
                                 out << "\t" << tc::bold << "ssh -i " << m_context.settings.user_key_file(m_context.username) << 
                                        " root@localhost -p" << tunnel_ret.local_port << tc::reset << std::endl;
+                                register_proxy_target(out, name, data["host"].get<std::string>(), data["port"].get<int>());
                                 out << "note: stopping this session will terminate the tunnel and interactive container." << std::endl;
                             } else {
                                 out << "failed." << std::endl;
@@ -189,24 +174,39 @@ session_commands::session_start_interactive(std::ostream& out,
                 }
             }
         }
+        progress.render();
     }
 }
 
+void
+session_commands::register_proxy_target(std::ostream& out, const std::string& name,
+                                        const std::string& host, unsigned int port)
+{
+    if(name == app_context::RSYNC_PROXY_TARGET) {
+        // reserved for the workspace sync, only the local port works.
+        return;
+    }
+    m_context.settings.set_proxy_target(m_context.username, name, host, port);
+    out << "or, without the local port, straight through the bastion by running:" << std::endl;
+    out << "\t" << tc::bold << "ssh -i " << m_context.settings.user_key_file(m_context.username) << 
+           " -o ProxyCommand='" << m_context.program << " proxy " << name << " -u " << m_context.username << "'" <<
+           " root@" << name << tc::reset << std::endl;
+}
+
 void
 session_commands::session_join_interactive(std::ostream& out, const std::string& name)
 {
-    int sbs_msg_id = m_context.gql_manager.subscribe_to_data_stream();
     int msg_id = m_context.gql_manager.session_join(name);
     bool in_progress = false;
 
     while(true) {
-        auto response = m_context.gql_manager.wait_for_response({msg_id, sbs_msg_id});
+        auto response = m_context.gql_manager.wait_for_response({msg_id});
 
         if(response.first) {
             if(in_progress) {
                 out << std::endl;
             }
-            out<< "interrupted..." << std::endl;
+            out << (response.first == gql_connection_manager::TIMED_OUT ? "request timed out..." : "interrupted...") << std::endl;
             break;
         }
 
@@ -243,6 +243,7 @@ session_commands::session_join_interactive(std::ostream& out, const std::string&
                         out << "done." << std::endl;
                         out << "\t" << tc::bold << "ssh -i " << m_context.settings.user_key_file(m_context.username) << 
                                 " root@localhost -p" << tunnel_ret.local_port << tc::reset << std::endl;
+                        register_proxy_target(out, name, data["host"].get<std::string>(), data["port"].get<int>());
                         out << "note: stopping this session will terminate the tunnel and interactive container." << std::endl;
                     } else {
                         out << "failed." << std::endl;
@@ -251,11 +252,6 @@ session_commands::session_join_interactive(std::ostream& out, const std::string&
                 } else {
                     out << "missing diagnostics data (communication error?)..." << std::endl;
                 }
-
-
-            } else
-            if(data_msg["id"] == sbs_msg_id) {
-
             }
         }
     }
@@ -266,6 +262,7 @@ session_commands::session_stop_interactive(std::ostream& out, const std::string&
 {
     out << "terminating the ssh tunnel... ";
     m_context.ssh.stop_ssh_tunnel(name);
+    m_context.settings.remove_proxy_target(m_context.username, name);
     out << "done" << std::endl;
     bool cancel = false;
     int msg_id = m_context.gql_manager.session_stop(name, cancel);
@@ -314,56 +311,71 @@ void
 session_commands::session_save(std::ostream& out, const std::string& name, 
                                const std::string& dockerimage, const std::string& comment)
 {
-    int sbs_msg_id = m_context.gql_manager.subscribe_to_data_stream();
+    data_stream_subscription sbs(m_context.gql_manager, 
+                                 {"push_data", "push_success", "register_success", 
+                                  "commit_error", "push_error", "register_error", "save_error"});
+    int sbs_msg_id = sbs.id();
     int msg_id = m_context.gql_manager.session_save(name, dockerimage, comment);
+    progress_coalescer progress(out, "saving:");
     bool in_progress = false;
    
     while(true) {
         auto response = m_context.gql_manager.wait_for_response({msg_id, sbs_msg_id});
         if(response.first) {
-            if(in_progress) {
-                out << std::endl;
-            }
-            out << "interrupted, the docker image will be saved in the background..." << std::endl;
+            progress.finish();
+            out << (response.first == gql_connection_manager::TIMED_OUT ? "request timed out" : "interrupted")
+                << ", the docker image will be saved in the background..." << std::endl;
             break;
         }
 
         for(const auto& data_msg : response.second ) {
-            PLOGV << "session save response: " << data_msg.dump(4);
 
             if(!data_msg.contains("payload") || data_msg["payload"] == nullptr) {
                 continue;
             }
             if(data_msg["type"] == "error") {
+                progress.finish();
                 out << "datastream error (abnormal query?)..." << std::endl;
                 return;
             } else 
             if(data_msg["payload"].contains("errors")) {
+                progress.finish();
                 out << "error: "<<data_msg["payload"]["errors"][0]["message"].get<std::string>() << std::endl;
                 return;
             }
 
+            if(data_msg["id"] == msg_id) {
+                PLOGV << "session save response: " << data_msg.dump(4);
+            } else
             if(data_msg["id"] == sbs_msg_id) {
                 if(data_msg["payload"].contains("data")) {
 
-                    auto msg = nlohmann::json::parse(data_msg["payload"]["data"]["subsData"]["message"].get<std::string>());
+                    auto msg = gql_connection_manager::data_stream_event(data_msg);
                     if(msg["type"] == "push_data") {
-                        auto data = nlohmann::json::parse(msg["data"].get<std::string>());
+                        auto& data = msg["data"];
+                        if(!data.is_object() || !data.contains("id") || !data["id"].is_string()) {
+                            continue;
+                        }
+                        const std::string layer = data["id"].get<std::string>();
                         if(data["status"] == "Pushing") {
                             if(in_progress == false) {
                                 out << "preparing for save..." << std::endl;
                                 in_progress = true;
                             }                            
-                            float done = data["progressDetail"]["current"].get<int>();
-                            float total = data["progressDetail"]["total"].get<int>();
-                            show_progress(out, "saving:", done/total);
+                            auto& detail = data["progressDetail"];
+                            if(detail.contains("current") && detail.contains("total")) {
+                                progress.update(layer, 0, detail["current"].get<int64_t>(), 
+                                                          detail["total"].get<int64_t>());
+                            }
                         }
                         if(data["status"] == "Pushed") {
-                            show_progress(out, "saving:", 1.0);
-                            out << std::endl; 
+                            progress.complete(layer, 0);
                         }
+                        continue;
+                    }
 
-                    } else 
+                    PLOGV << "session save event: " << msg.dump(4);
+                    progress.finish();
                     if(msg["type"] == "push_success") {
                         out << "docker image is saved." << std::endl;
                     } else 
@@ -397,6 +409,7 @@ session_commands::session_save(std::ostream& out, const std::string& name,
                 }
             }
         }
+        progress.render();
     }
 }
 
@@ -24,6 +24,9 @@ private:
     void session_start_interactive(std::ostream& out, const std::string& name,
                                    const std::string& dockerimage, const std::string& platform);
     void session_join_interactive(std::ostream& out, const std::string& name);
+    // lets 'metriffic proxy <name>' reach the container and shows how.
+    void register_proxy_target(std::ostream& out, const std::string& name,
+                               const std::string& host, unsigned int port);
     void session_stop_interactive(std::ostream& out, const std::string& name);
     void session_stop_batch(std::ostream& out, const std::string& name);
     void session_save(std::ostream& out, const std::string& name, 
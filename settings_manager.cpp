@@ -49,6 +49,46 @@ settings_manager::set_workspace(const std::string& username, const std::string&
     return true;
 }
 
+std::tuple<bool, std::string, unsigned int>
+settings_manager::proxy_target(const std::string& username, const std::string& session)
+{
+    if(m_settings[USERS_TAG].count(username) == 0 ||
+       m_settings[USERS_TAG][username].count(PROXY_TARGETS_TAG) == 0 ||
+       m_settings[USERS_TAG][username][PROXY_TARGETS_TAG].count(session) == 0) {
+        return std::make_tuple(false, "", 0);
+    }
+    auto target = m_settings[USERS_TAG][username][PROXY_TARGETS_TAG][session];
+    return std::make_tuple(true, target[HOST_TAG].get<std::string>(), 
+                                 target[PORT_TAG].get<unsigned int>());
+}
+
+bool
+settings_manager::set_proxy_target(const std::string& username, const std::string& session,
+                                   const std::string& host, unsigned int port)
+{
+    if(m_settings[USERS_TAG].count(username) == 0) {
+        return false;
+    }
+    m_settings[USERS_TAG][username][PROXY_TARGETS_TAG][session] = {
+        {HOST_TAG, host},
+        {PORT_TAG, port}
+    };
+    save();
+    return true;
+}
+
+bool
+settings_manager::remove_proxy_target(const std::string& username, const std::string& session)
+{
+    if(m_settings[USERS_TAG].count(username) == 0 ||
+       m_settings[USERS_TAG][username].count(PROXY_TARGETS_TAG) == 0) {
+        return false;
+    }
+    m_settings[USERS_TAG][username][PROXY_TARGETS_TAG].erase(session);
+    save();
+    return true;
+}
+
 bool
 settings_manager::user_config_exists(const std::string& username)
 {
@@ -73,6 +113,12 @@ settings_manager::user_key_file(const std::string& username)
     return m_path.parent_path() / username / KEYS_TAG / "user_key";
 }
 
+std::string
+settings_manager::workspace_manifest_file(const std::string& username)
+{
+    return m_path.parent_path() / username / MANIFEST_FILE;
+}
+
 
 void 
 settings_manager::load()
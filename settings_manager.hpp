@@ -24,8 +24,17 @@ public:
     std::string log_file();
     std::string bastion_key_file(const std::string& username);
     std::string user_key_file(const std::string& username);
+    // what the last 'sync up' left on the remote side, see workspace_manifest.
+    std::string workspace_manifest_file(const std::string& username);
+    // where the container of a session is reached from the bastion, for
+    // the stdio proxy started by ssh in another process.
+    std::tuple<bool, std::string, unsigned int> proxy_target(const std::string& username, 
+                                                             const std::string& session);
     // mutators
     bool set_workspace(const std::string& username, const std::string& path);
+    bool set_proxy_target(const std::string& username, const std::string& session,
+                          const std::string& host, unsigned int port);
+    bool remove_proxy_target(const std::string& username, const std::string& session);
 
 private:
     std::filesystem::path m_path;
@@ -33,7 +42,11 @@ private:
     const std::string WORKSPACE_TAG = "workspace";
     const std::string USERS_TAG = "users";
     const std::string KEYS_TAG = "keys";
+    const std::string MANIFEST_FILE = "workspace.manifest";
     const std::string PATH_TAG = "path";
+    const std::string PROXY_TARGETS_TAG = "proxy_targets";
+    const std::string HOST_TAG = "host";
+    const std::string PORT_TAG = "port";
 };
 
 } // namespace metriffic
@@ -0,0 +1,109 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace metriffic
+{
+
+// fixed-capacity single-producer/single-consumer queue. Elements are moved
+// in and out of preallocated slots, a push into a full ring is rejected and
+// accounted as an overflow.
+template<typename T>
+class spsc_ring
+{
+public:
+    explicit spsc_ring(size_t capacity)
+     : m_capacity(round_up(capacity)),
+       m_mask(m_capacity - 1),
+       m_slots(new T[m_capacity])
+    {}
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    // producer side
+    bool push(T&& value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        if(head - tail == m_capacity) {
+            m_overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        m_slots[head & m_mask] = std::move(value);
+        m_head.store(head + 1, std::memory_order_release);
+
+        const size_t depth = head + 1 - tail;
+        if(depth > m_high_water.load(std::memory_order_relaxed)) {
+            m_high_water.store(depth, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // consumer side
+    bool pop(T& value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        if(tail == head) {
+            return false;
+        }
+        value = std::move(m_slots[tail & m_mask]);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t size() const
+    {
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        return head - tail;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    size_t high_water() const
+    {
+        return m_high_water.load(std::memory_order_relaxed);
+    }
+
+    size_t overflows() const
+    {
+        return m_overflows.load(std::memory_order_relaxed);
+    }
+
+private:
+    static size_t round_up(size_t capacity)
+    {
+        size_t rounded = 1;
+        while(rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    const size_t m_capacity;
+    const size_t m_mask;
+    std::unique_ptr<T[]> m_slots;
+
+    // producer and consumer indices live on separate cache lines.
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    alignas(64) std::atomic<size_t> m_high_water{0};
+    std::atomic<size_t> m_overflows{0};
+};
+
+} // namespace metriffic
+
+#endif //SPSC_RING_HPP
@@ -1,6 +1,9 @@
 #include <nlohmann/json.hpp>
 #include <plog/Log.h>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <fstream>
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
@@ -18,83 +21,1114 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <cstring>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include "ssh_manager.hpp"
+#include "resolver.hpp"
 
 namespace fs = std::filesystem;
 
 namespace metriffic
 {
 
-ssh_manager::ssh_tunnel::ssh_tunnel(
-               const std::string& username,
-               const std::string& bastion_public_key,
-               const std::string& bastion_private_key,
-               const std::string& local_host,
-               std::pair<unsigned int, unsigned int> local_port_range,
-               const std::string& bastion_host,
-               const unsigned int bastion_port,
-               const std::string& dest_host,
-               const unsigned int dest_port) 
-  : m_should_stop(false),
-    m_username(username),
-    m_bastion_public_key(bastion_public_key),
-    m_bastion_private_key(bastion_private_key),
-    m_local_host(local_host),
-    m_local_port_range(local_port_range),
-    m_bastion_host(bastion_host),
-    m_bastion_port(bastion_port),
-    m_dest_host(dest_host),
-    m_dest_port(dest_port),
-    m_local_port(-1),
-    m_listen_sock(-1)
+namespace
+{
+#ifdef MSG_NOSIGNAL
+    const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    const int SEND_FLAGS = 0;
+#endif
+
+    // seconds between the keepalives of a session, well below the usual
+    // NAT idle timeouts.
+    const int KEEPALIVE_INTERVAL = 30;
+    // unacknowledged data, the keepalives included, fails the bastion
+    // socket after this long rather than after the many minutes of TCP
+    // retransmissions. Shorter network blips go unnoticed.
+    const unsigned int DEAD_PEER_TIMEOUT_MS = 3 * KEEPALIVE_INTERVAL * 1000;
+    // reconnect attempts of a tunnel's transport back off up to this.
+    const int MAX_RETRY_DELAY = 30;
+
+    bool
+    set_non_blocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+    }
+
+    // libssh2 writes whole packets, Nagle would only delay their tails.
+    void
+    tune_socket(int fd, int buffer_size)
+    {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        if(buffer_size > 0) {
+            // the kernel may clamp these to net.core.[rw]mem_max.
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        }
+    }
+
+    void
+    append_uint32(std::string& msg, uint32_t value)
+    {
+        for(int shift = 24; shift >= 0; shift -= 8) {
+            msg.push_back(char((value >> shift) & 0xff));
+        }
+    }
+
+    void
+    append_ssh_string(std::string& msg, const std::string& value)
+    {
+        append_uint32(msg, value.size());
+        msg.append(value);
+    }
+
+    void
+    set_blocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if(flags != -1) {
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+
+    resolver&
+    bastion_resolver()
+    {
+        static resolver r;
+        return r;
+    }
+
+    // races the addresses of the bastion: a new attempt starts every
+    // CONNECT_ATTEMPT_DELAY, or as soon as one fails, while the earlier
+    // ones are still pending and the first one to connect wins (RFC 8305).
+    // Returns a blocking socket, errno tells why if it fails.
+    int
+    connect_to_bastion(const std::string& host, unsigned int bastion_port, int buffer_size,
+                       const std::atomic<bool>& canceled)
+    {
+        typedef std::chrono::steady_clock clock;
+        const auto CONNECT_ATTEMPT_DELAY = std::chrono::milliseconds(250);
+        const auto CONNECT_TIMEOUT = std::chrono::seconds(15);
+        const auto CANCEL_CHECK_PERIOD = std::chrono::milliseconds(100);
+
+        auto addrs = bastion_resolver().resolve(host, bastion_port);
+        if(addrs.empty()) {
+            errno = EHOSTUNREACH;
+            return -1;
+        }
+
+        std::vector<struct pollfd> attempts;
+        size_t next = 0;
+        int sd = -1;
+        int error = ECONNREFUSED;
+        auto now = clock::now();
+        const auto deadline = now + CONNECT_TIMEOUT;
+        auto next_attempt = now;
+        while(sd == -1) {
+            now = clock::now();
+            if(next < addrs.size() && (now >= next_attempt || attempts.empty())) {
+                const auto& addr = addrs[next++];
+                next_attempt = now + CONNECT_ATTEMPT_DELAY;
+                int fd = socket(addr.family, SOCK_STREAM, IPPROTO_TCP);
+                if(fd == -1) {
+                    error = errno;
+                    continue;
+                }
+                // buffer sizes must be set before connecting to take part
+                // in the window scaling.
+                tune_socket(fd, buffer_size);
+#ifdef TCP_USER_TIMEOUT
+                setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                           &DEAD_PEER_TIMEOUT_MS, sizeof(DEAD_PEER_TIMEOUT_MS));
+#endif
+                set_non_blocking(fd);
+                if(connect(fd, (const struct sockaddr*)&addr.addr, addr.len) == 0) {
+                    sd = fd;
+                } else
+                if(errno == EINPROGRESS) {
+                    attempts.push_back({fd, POLLOUT, 0});
+                } else {
+                    error = errno;
+                    close(fd);
+                }
+                continue;
+            }
+            if(attempts.empty()) {
+                break;
+            }
+            if(now >= deadline) {
+                error = ETIMEDOUT;
+                break;
+            }
+            if(canceled) {
+                error = ECANCELED;
+                break;
+            }
+            auto until = next < addrs.size() ? std::min(next_attempt, deadline) : deadline;
+            until = std::min(until, now + CANCEL_CHECK_PERIOD);
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+            if(poll(attempts.data(), attempts.size(), int(wait)) < 0 && errno != EINTR) {
+                error = errno;
+                break;
+            }
+            for(auto it = attempts.begin(); it != attempts.end();) {
+                if(it->revents == 0) {
+                    ++it;
+                    continue;
+                }
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(it->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err == 0 && sd == -1) {
+                    sd = it->fd;
+                } else {
+                    error = err ? err : error;
+                    close(it->fd);
+                    next_attempt = now;
+                }
+                it = attempts.erase(it);
+            }
+        }
+        for(const auto& attempt : attempts) {
+            close(attempt.fd);
+        }
+        if(sd == -1) {
+            // the addresses may have moved.
+            bastion_resolver().invalidate(host, bastion_port);
+            errno = error;
+            return -1;
+        }
+        // the ssh handshake blocks, the transport goes non-blocking once
+        // it adopts the session.
+        set_blocking(sd);
+        return sd;
+    }
+
+    double
+    elapsed_ms(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+}
+
+void
+ssh_manager::rate_meter::sample(uint64_t total, clock::time_point now)
+{
+    // the weight of a sample grows with the time it covers, the average
+    // decays with a time constant of a few seconds.
+    constexpr double TIME_CONSTANT = 5.0;
+    double dt = std::chrono::duration<double>(now - m_last).count();
+    if(dt <= 0) {
+        return;
+    }
+    double current = double(total - m_total) / dt;
+    m_rate += (1.0 - std::exp(-dt / TIME_CONSTANT)) * (current - m_rate);
+    m_total = total;
+    m_last = now;
+}
+
+ssh_manager::io_buffer::io_buffer(size_t capacity)
+ : m_data(capacity)
+{}
+
+char*
+ssh_manager::io_buffer::write_ptr()
+{
+    if(m_begin > 0 && m_data.size() - m_end < m_begin) {
+        // move the unread bytes to the front once there's more room there
+        // than at the end.
+        std::memmove(m_data.data(), m_data.data() + m_begin, readable());
+        m_end -= m_begin;
+        m_begin = 0;
+    }
+    return m_data.data() + m_end;
+}
+
+void
+ssh_manager::io_buffer::consumed(size_t n)
+{
+    m_begin += n;
+    if(m_begin == m_end) {
+        m_begin = m_end = 0;
+    }
+}
+
+const ssh_manager::profile_settings&
+ssh_manager::settings_of(tunnel_profile profile)
+{
+    // AEAD ciphers don't use the MAC, the MACs are for the ctr fallbacks.
+    static const profile_settings interactive = {
+        "interactive",
+        LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+        LIBSSH2_CHANNEL_PACKET_DEFAULT,
+        16 * 1024,
+        0,
+        "curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,"
+        "diffie-hellman-group14-sha256,ext-info-c,kex-strict-c-v00@openssh.com",
+        "chacha20-poly1305@openssh.com,aes128-gcm@openssh.com,aes128-ctr,aes256-ctr",
+        "hmac-sha2-256-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1"
+    };
+    // large window to keep a high-RTT link busy, AES-GCM goes first
+    // as it's hardware accelerated on most of the machines.
+    static const profile_settings bulk = {
+        "bulk",
+        16 * 1024 * 1024,
+        LIBSSH2_CHANNEL_PACKET_DEFAULT,
+        256 * 1024,
+        4 * 1024 * 1024,
+        "curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,"
+        "diffie-hellman-group14-sha256,ext-info-c,kex-strict-c-v00@openssh.com",
+        "aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com,aes128-ctr,aes256-ctr",
+        "hmac-sha2-256-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1"
+    };
+    return profile == BULK ? bulk : interactive;
+}
+
+ssh_manager::connection::connection(size_t buffer_size)
+  : tunnel_id(0),
+    dest_port(0),
+    channel(NULL),
+    forwardsock(-1),
+    outsock(-1),
+    src_port(0),
+    to_channel(buffer_size),
+    to_client(buffer_size)
+{}
+
+ssh_manager::connection::~connection()
+{
+    // the channel belongs to the session, the transport frees it.
+    close_client();
+}
+
+void
+ssh_manager::connection::close_client()
+{
+    if(forwardsock != -1) {
+        close(forwardsock);
+        forwardsock = -1;
+    }
+    if(outsock != -1) {
+        close(outsock);
+        outsock = -1;
+    }
+    if(on_finished) {
+        auto finished = std::move(on_finished);
+        on_finished = nullptr;
+        finished(error);
+    }
+}
+
+void
+ssh_manager::connection::reset()
+{
+    close_client();
+    tunnel_id = 0;
+    channel = NULL;
+    src_port = 0;
+    to_channel.clear();
+    to_client.clear();
+    client_eof = false;
+    eof_sent = false;
+    channel_eof = false;
+    failed = false;
+    released = false;
+    error.clear();
+    metrics.reset();
+    bytes_out = 0;
+    bytes_in = 0;
+    channel_open_ms = 0;
+}
+
+ssh_manager::connection_pool::connection_pool(size_t buffer_size)
+  : m_buffer_size(buffer_size)
+{}
+
+ssh_manager::connection_ptr
+ssh_manager::connection_pool::acquire()
+{
+    if(m_free.empty()) {
+        return std::make_shared<connection>(m_buffer_size);
+    }
+    connection_ptr c = std::move(m_free.back());
+    m_free.pop_back();
+    return c;
+}
+
+void
+ssh_manager::connection_pool::recycle(const connection_ptr& c)
+{
+    // closes the socket right away, whether the record is kept or not.
+    c->reset();
+    if(m_free.size() < POOL_CAPACITY) {
+        m_free.push_back(c);
+    }
+}
+
+void
+ssh_manager::bandwidth_scheduler::set_caps(const bandwidth_caps& caps)
+{
+    m_caps = caps;
+    for(auto& b : m_buckets) {
+        b = bucket();
+    }
+}
+
+uint64_t
+ssh_manager::bandwidth_scheduler::rate_of(tunnel_profile profile, clock::time_point now) const
+{
+    // keystrokes come in bursts, a short pause doesn't end the session.
+    constexpr auto INTERACTIVE_HOLD = std::chrono::seconds(2);
+    if(profile == INTERACTIVE) {
+        return m_caps.interactive;
+    }
+    uint64_t rate = m_caps.bulk;
+    if(m_caps.bulk_yield && now - m_last_interactive < INTERACTIVE_HOLD) {
+        rate = rate ? std::min(rate, m_caps.bulk_yield) : m_caps.bulk_yield;
+    }
+    return rate;
+}
+
+double
+ssh_manager::bandwidth_scheduler::burst_of(uint64_t rate)
+{
+    // 100 ms worth of data, at least a few packets.
+    return std::max(rate / 10.0, 4.0 * LIBSSH2_CHANNEL_PACKET_DEFAULT);
+}
+
+double
+ssh_manager::bandwidth_scheduler::min_write_of(uint64_t rate)
+{
+    // waiting for a whole packet keeps a slow bucket from trickling out
+    // a few bytes per poll round.
+    return std::min(burst_of(rate), double(LIBSSH2_CHANNEL_PACKET_DEFAULT));
+}
+
+size_t
+ssh_manager::bandwidth_scheduler::allowance(tunnel_profile profile)
+{
+    if(profile == INTERACTIVE ? !m_caps.interactive : !m_caps.bulk && !m_caps.bulk_yield) {
+        return std::numeric_limits<size_t>::max();
+    }
+    auto now = clock::now();
+    bucket& b = m_buckets[profile];
+    uint64_t rate = rate_of(profile, now);
+    if(rate == 0) {
+        b.rate = 0;
+        b.last = now;
+        return std::numeric_limits<size_t>::max();
+    }
+    double dt = std::chrono::duration<double>(now - b.last).count();
+    b.tokens = std::min(b.tokens + dt * rate, burst_of(rate));
+    b.rate = rate;
+    b.last = now;
+    return b.tokens >= min_write_of(rate) ? size_t(b.tokens) : 0;
+}
+
+void
+ssh_manager::bandwidth_scheduler::consumed(tunnel_profile profile, size_t n)
+{
+    if(profile == INTERACTIVE) {
+        m_last_interactive = clock::now();
+    }
+    bucket& b = m_buckets[profile];
+    if(b.rate) {
+        b.tokens -= n;
+    }
+}
+
+ssh_manager::clock::time_point
+ssh_manager::bandwidth_scheduler::next_refill(tunnel_profile profile) const
+{
+    const bucket& b = m_buckets[profile];
+    if(b.rate == 0) {
+        return clock::now();
+    }
+    double missing = std::max(min_write_of(b.rate) - b.tokens, 0.0);
+    return b.last + std::chrono::duration_cast<clock::duration>(
+                        std::chrono::duration<double>(missing / b.rate));
+}
+
+bool
+ssh_manager::setup_canceler::track(int sock)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if(m_canceled) {
+        return false;
+    }
+    m_sockets.insert(sock);
+    return true;
+}
+
+void
+ssh_manager::setup_canceler::untrack(int sock)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_sockets.erase(sock);
+}
+
+void
+ssh_manager::setup_canceler::cancel()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_canceled = true;
+    // the blocking handshake or authentication on them fails right away.
+    for(int sock : m_sockets) {
+        shutdown(sock, SHUT_RDWR);
+    }
+}
+
+ssh_manager::bastion_session::~bastion_session()
+{
+    if(canceler) {
+        // before the descriptor can be reused.
+        canceler->untrack(sock);
+    }
+    if(session) {
+        // don't let a dead bastion hang the reactor.
+        libssh2_session_set_timeout(session, 2000);
+        libssh2_session_set_blocking(session, 1);
+        libssh2_session_disconnect(session, "");
+        libssh2_session_free(session);
+    }
+    if(sock != -1) {
+        close(sock);
+    }
+}
+
+ssh_manager::bastion_transport::bastion_transport(const tunnel_config& config,
+                                                 bandwidth_scheduler& scheduler)
+  : m_config(config),
+    m_scheduler(scheduler),
+    m_pool(settings_of(config.profile).io_buffer_size)
 {}
 
-ssh_manager::ssh_tunnel::~ssh_tunnel() 
+ssh_manager::bastion_transport::~bastion_transport()
+{
+    disconnect();
+}
+
+std::string
+ssh_manager::bastion_transport::key_of(const tunnel_config& config)
+{
+    return config.username + "@" + config.bastion_host + ":" + std::to_string(config.bastion_port) +
+           "/" + settings_of(config.profile).name;
+}
+
+ssh_manager::bastion_session_ptr
+ssh_manager::bastion_transport::start_session(const tunnel_config& config, setup_canceler& canceler,
+                                              bool preferred_methods, int& rc, std::string& error)
+{
+    const auto& settings = settings_of(config.profile);
+    auto s = std::make_shared<bastion_session>();
+    rc = 0;
+    // Connect to SSH server
+    auto started = clock::now();
+    s->sock = connect_to_bastion(config.bastion_host, config.bastion_port,
+                                 settings.socket_buffer_size, canceler.canceled());
+    s->connect_ms = elapsed_ms(started);
+    if(s->sock == -1) {
+        error = "failed to connect to the bastion " + config.bastion_host + ": " + strerror(errno);
+        PLOGE << "[bastion] error: " << error;
+        return nullptr;
+    }
+    if(!canceler.track(s->sock)) {
+        error = "canceled";
+        return nullptr;
+    }
+    s->canceler = &canceler;
+    // Create a session instance
+    s->session = libssh2_session_init();
+
+    if(!s->session) {
+        error = "could not initialize the ssh session";
+        PLOGE << "[bastion] error: " << error;
+        return nullptr;
+    }
+    if(preferred_methods) {
+        const std::pair<int, const char*> prefs[] = {
+            {LIBSSH2_METHOD_KEX,      settings.kex},
+            {LIBSSH2_METHOD_CRYPT_CS, settings.ciphers},
+            {LIBSSH2_METHOD_CRYPT_SC, settings.ciphers},
+            {LIBSSH2_METHOD_MAC_CS,   settings.macs},
+            {LIBSSH2_METHOD_MAC_SC,   settings.macs}
+        };
+        for(const auto& pref : prefs) {
+            // methods libssh2 isn't built with are skipped, it fails only
+            // if none is left and keeps the defaults then.
+            if(libssh2_session_method_pref(s->session, pref.first, pref.second)) {
+                PLOGW << "[bastion] none of the preferred methods is supported: " << pref.second;
+            }
+        }
+    }
+    // Start it up. This will trade welcome banners, exchange keys,
+    // and setup crypto, compression, and MAC layers
+    started = clock::now();
+    rc = libssh2_session_handshake(s->session, s->sock);
+    s->handshake_ms = elapsed_ms(started);
+
+    if(rc) {
+        error = "ssh handshake with the bastion failed: " + std::to_string(rc);
+        PLOGE << "[bastion] error: " << error;
+        return nullptr;
+    }
+    return s;
+}
+
+ssh_manager::bastion_session_ptr
+ssh_manager::bastion_transport::establish(const tunnel_config& config, setup_canceler& canceler,
+                                          std::string& error)
+{
+    int rc = 0;
+    auto s = start_session(config, canceler, true, rc, error);
+    if(!s && rc == LIBSSH2_ERROR_KEX_FAILURE && !canceler.canceled()) {
+        PLOGW << "[bastion] no agreement on the preferred methods, falling back to the defaults";
+        s = start_session(config, canceler, false, rc, error);
+    }
+    if(!s) {
+        return nullptr;
+    }
+
+    auto started = clock::now();
+    if(libssh2_userauth_publickey_fromfile(s->session,
+                                           config.username.c_str(),
+                                           config.bastion_public_key.c_str(),
+                                           config.bastion_private_key.c_str(),
+                                           "")) {
+        error = "authentication to the bastion by private key failed";
+        PLOGE << "[bastion] error: " << error;
+        return nullptr;
+    }
+    s->auth_ms = elapsed_ms(started);
+    PLOGV << "[bastion] authentication  by private key is succeeded!";
+    PLOGV << "[bastion] " << settings_of(config.profile).name << " session uses "
+          << libssh2_session_methods(s->session, LIBSSH2_METHOD_KEX) << ", "
+          << libssh2_session_methods(s->session, LIBSSH2_METHOD_CRYPT_CS) << ", "
+          << libssh2_session_methods(s->session, LIBSSH2_METHOD_MAC_CS);
+    // set up, the reactor owns it from here.
+    canceler.untrack(s->sock);
+    s->canceler = nullptr;
+    return s;
+}
+
+uint64_t
+ssh_manager::bastion_transport::begin_connect()
+{
+    m_retry_pending = false;
+    m_state = CONNECTING;
+    return ++m_generation;
+}
+
+void
+ssh_manager::bastion_transport::adopt(uint64_t generation, bastion_session_ptr session,
+                                      const std::string& error)
+{
+    if(m_state != CONNECTING || generation != m_generation) {
+        // a stale attempt, the transport moved on.
+        return;
+    }
+    if(!session) {
+        PLOGE << "[bastion] error: no session to " << key_of(m_config)
+              << ", dropping " << m_connections.size() << " connection(s)";
+        for(const auto& c : m_connections) {
+            if(c->metrics) {
+                ++c->metrics->connections_failed;
+            }
+            c->error = error;
+        }
+        m_state = DISCONNECTED;
+        m_connections.clear();
+        return;
+    }
+    // must use non-blocking IO hereafter, the reactor serves all the channels.
+    libssh2_session_set_blocking(session->session, 0);
+    set_non_blocking(session->sock);
+    // replies are asked for so there's traffic to acknowledge both ways.
+    libssh2_keepalive_config(session->session, 1, KEEPALIVE_INTERVAL);
+    m_next_keepalive = clock::now() + std::chrono::seconds(KEEPALIVE_INTERVAL);
+    m_session = session;
+    m_last_session = session;
+    ++m_sessions;
+    m_retries = 0;
+    m_state = READY;
+    m_lost = false;
+    m_block_directions = 0;
+    PLOGV << "[bastion] transport " << key_of(m_config) << " is ready";
+}
+
+void
+ssh_manager::bastion_transport::disconnect()
+{
+    // freeing the session frees its channels as well.
+    for(auto it = m_connections.begin(); it != m_connections.end();) {
+        connection_ptr c = *it;
+        if(c->channel == NULL && !c->failed) {
+            ++it;
+            continue;
+        }
+        it = m_connections.erase(it);
+        c->channel = NULL;
+        if(c->error.empty()) {
+            c->error = "the ssh session to the bastion was lost";
+        }
+        m_pool.recycle(c);
+    }
+    m_opening.reset();
+    m_closing.clear();
+    m_blocked_op = OP_NONE;
+    m_blocked_conn.reset();
+    m_block_directions = 0;
+    m_session.reset();
+    m_state = DISCONNECTED;
+    ++m_generation;
+}
+
+void
+ssh_manager::bastion_transport::release(const connection_ptr& c)
+{
+    c->released = true;
+    c->close_client();
+    m_connections.remove(c);
+    if(c == m_opening || c == m_blocked_conn) {
+        // a libssh2 call of it is in progress, it's retired once that
+        // call is over.
+        return;
+    }
+    retire(c);
+}
+
+void
+ssh_manager::bastion_transport::retire(const connection_ptr& c)
+{
+    if(c->channel) {
+        m_closing.push_back(c->channel);
+        c->channel = NULL;
+    }
+    m_pool.recycle(c);
+}
+
+bool
+ssh_manager::bastion_transport::keepalive(clock::time_point now)
+{
+    if(m_state != READY) {
+        return true;
+    }
+    if(m_lost || now < m_next_keepalive) {
+        return !m_lost;
+    }
+    // a keepalive left half-sent would have to be completed by the next
+    // send, which libssh2 refuses as a different packet. It's only sent
+    // when the socket has room for it, a busy session needs none anyway.
+    struct pollfd pfd = {m_session->sock, POLLOUT, 0};
+    if(m_blocked_op != OP_NONE || poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) {
+        if(pfd.revents & (POLLERR | POLLHUP)) {
+            m_lost = true;
+            return false;
+        }
+        m_next_keepalive = now + std::chrono::seconds(1);
+        return true;
+    }
+    int seconds_to_next = 0;
+    int rc = libssh2_keepalive_send(m_session->session, &seconds_to_next);
+    if(rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+        fail(nullptr, rc, "libssh2_keepalive_send");
+        return false;
+    }
+    m_next_keepalive = now + std::chrono::seconds(seconds_to_next > 0 ? seconds_to_next
+                                                                      : KEEPALIVE_INTERVAL);
+    return true;
+}
+
+void
+ssh_manager::bastion_transport::schedule_retry(clock::time_point now)
+{
+    int delay = std::min(MAX_RETRY_DELAY, 1 << std::min(m_retries, 5u));
+    ++m_retries;
+    m_retry_pending = true;
+    m_retry_at = now + std::chrono::seconds(delay);
+    PLOGW << "[bastion] retrying " << key_of(m_config) << " in " << delay << " s";
+}
+
+bool
+ssh_manager::bastion_transport::retry_due(clock::time_point now) const
+{
+    return m_state == DISCONNECTED && m_retry_pending && now >= m_retry_at;
+}
+
+ssh_manager::clock::time_point
+ssh_manager::bastion_transport::next_timer() const
+{
+    if(m_state == READY) {
+        return m_next_keepalive;
+    }
+    if(m_state == DISCONNECTED && m_retry_pending) {
+        return m_retry_at;
+    }
+    return clock::time_point::max();
+}
+
+short
+ssh_manager::bastion_transport::poll_events() const
+{
+    if(m_state != READY) {
+        return 0;
+    }
+    if(m_blocked_op != OP_NONE) {
+        // nothing else can go before the blocked call.
+        return POLLOUT;
+    }
+    // libssh2 tells which way it's blocked, besides that the bastion socket
+    // is only read when some channel has room for the data.
+    short events = 0;
+    if(m_block_directions & LIBSSH2_SESSION_BLOCK_INBOUND) {
+        events |= POLLIN;
+    }
+    if(m_block_directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+        events |= POLLOUT;
+    }
+    for(const auto& c : m_connections) {
+        if(c->channel && !c->channel_eof && c->to_client.writable() > 0) {
+            events |= POLLIN;
+            break;
+        }
+    }
+    return events;
+}
+
+bool
+ssh_manager::bastion_transport::would_block(op_t op, const connection_ptr& c)
+{
+    int dirs = libssh2_session_block_directions(m_session->session);
+    m_block_directions |= dirs;
+    if(dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+        m_blocked_op = op;
+        m_blocked_conn = c;
+        return true;
+    }
+    return false;
+}
+
+void
+ssh_manager::bastion_transport::fail(connection* c, int rc, const char* what)
+{
+    PLOGE << "[tunnel] error: " << what << ": " << rc;
+    // channel errors end the connection, anything else is the session.
+    if(c && rc <= LIBSSH2_ERROR_CHANNEL_OUTOFORDER && rc >= LIBSSH2_ERROR_CHANNEL_EOF_SENT) {
+        c->error = std::string(what) + ": " + std::to_string(rc);
+        c->failed = true;
+    } else {
+        m_lost = true;
+    }
+}
+
+bool
+ssh_manager::bastion_transport::open_channels()
+{
+    bool progress = false;
+    while(m_blocked_op == OP_NONE && !m_lost) {
+        if(!m_opening) {
+            for(auto& c : m_connections) {
+                if(!c->channel && !c->failed) {
+                    m_opening = c;
+                    break;
+                }
+            }
+            if(!m_opening) {
+                break;
+            }
+            PLOGV << "[host] trying to create a channel, dest " << m_opening->dest_host << ":" << m_opening->dest_port
+                  << ", src " << m_opening->src_host << ":" << m_opening->src_port;
+            m_opening->open_started = clock::now();
+        }
+        connection_ptr c = m_opening;
+        // libssh2_channel_direct_tcpip_ex() always uses the default window,
+        // the open request is built here to use the one of the profile.
+        const auto& settings = settings_of(m_config.profile);
+        std::string message;
+        append_ssh_string(message, c->dest_host);
+        append_uint32(message, c->dest_port);
+        append_ssh_string(message, c->src_host);
+        append_uint32(message, c->src_port);
+        LIBSSH2_CHANNEL* channel = libssh2_channel_open_ex(m_session->session,
+                                                           "direct-tcpip", sizeof("direct-tcpip") - 1,
+                                                           settings.window_size, settings.packet_size,
+                                                           message.data(), message.size());
+        if(!channel) {
+            int rc = libssh2_session_last_errno(m_session->session);
+            if(rc == LIBSSH2_ERROR_EAGAIN) {
+                would_block(OP_OPEN, c);
+                break;
+            }
+            m_opening.reset();
+            fail(c.get(), rc, "libssh2_channel_open_ex, failed to create a channel");
+            if(c->released) {
+                retire(c);
+            }
+            continue;
+        }
+        m_opening.reset();
+        progress = true;
+        c->channel = channel;
+        c->channel_open_ms = elapsed_ms(c->open_started);
+        if(c->metrics) {
+            ++c->metrics->channel_opens;
+            c->metrics->channel_open_ms += c->channel_open_ms;
+        }
+        if(c->released) {
+            // the tunnel was stopped while the channel was being opened.
+            retire(c);
+        }
+    }
+    return progress;
+}
+
+bool
+ssh_manager::bastion_transport::free_channels()
 {
+    bool progress = false;
+    auto it = m_closing.begin();
+    while(it != m_closing.end() && m_blocked_op == OP_NONE && !m_lost) {
+        int rc = libssh2_channel_free(*it);
+        if(rc == LIBSSH2_ERROR_EAGAIN) {
+            if(would_block(OP_FREE, nullptr)) {
+                break;
+            }
+            // waiting for the bastion to confirm the close.
+            ++it;
+            continue;
+        }
+        if(rc < 0) {
+            fail(nullptr, rc, "libssh2_channel_free");
+        }
+        it = m_closing.erase(it);
+        progress = true;
+    }
+    return progress;
 }
 
-ssh_manager::ssh_tunnel::one_session::one_session()
-  : session(NULL),
-    channel(NULL),
-    sock(-1),
-    forwardsock(-1)
-{}
+bool
+ssh_manager::bastion_transport::channel_write(const connection_ptr& c, size_t size)
+{
+    ssize_t wr = libssh2_channel_write(c->channel, c->to_channel.read_ptr(), size);
+    if(wr == LIBSSH2_ERROR_EAGAIN) {
+        if(c->metrics) {
+            ++c->metrics->channel_stalls;
+        }
+        m_blocked_size = size;
+        would_block(OP_WRITE, c);
+        return false;
+    }
+    if(wr < 0) {
+        fail(c.get(), wr, "libssh2_channel_write");
+        return false;
+    }
+    c->to_channel.consumed(wr);
+    m_scheduler.consumed(m_config.profile, wr);
+    c->bytes_out += wr;
+    if(c->metrics) {
+        c->metrics->bytes_out += wr;
+    }
+    return true;
+}
+
+bool
+ssh_manager::bastion_transport::send_eof(const connection_ptr& c)
+{
+    int rc = libssh2_channel_send_eof(c->channel);
+    if(rc == LIBSSH2_ERROR_EAGAIN) {
+        would_block(OP_EOF, c);
+        return false;
+    }
+    if(rc < 0) {
+        fail(c.get(), rc, "libssh2_channel_send_eof");
+        return false;
+    }
+    c->eof_sent = true;
+    return true;
+}
+
+bool
+ssh_manager::bastion_transport::channel_read(const connection_ptr& c)
+{
+    char* buf = c->to_client.write_ptr();
+    ssize_t len = libssh2_channel_read(c->channel, buf, c->to_client.write_size());
+    if(len == LIBSSH2_ERROR_EAGAIN) {
+        would_block(OP_READ, c);
+        return false;
+    }
+    if(len < 0) {
+        fail(c.get(), len, "libssh2_channel_read");
+        return false;
+    }
+    if(len == 0) {
+        if(libssh2_channel_eof(c->channel)) {
+            PLOGV << "[tunnel] the server disconnected";
+            c->channel_eof = true;
+        }
+        return false;
+    }
+    c->to_client.produced(len);
+    return true;
+}
 
-int 
-ssh_manager::ssh_tunnel::connect_to_bastion()
+bool
+ssh_manager::bastion_transport::resume_blocked()
 {
-    int sd = -1;
-    struct addrinfo hints = {}, *addrs;
-    hints.ai_family = AF_INET; 
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    op_t op = m_blocked_op;
+    connection_ptr c = m_blocked_conn;
+    m_blocked_op = OP_NONE;
+    m_blocked_conn.reset();
+    switch(op) {
+    case OP_OPEN:  open_channels(); break;
+    case OP_FREE:  free_channels(); break;
+    case OP_WRITE: channel_write(c, m_blocked_size); break;
+    case OP_EOF:   send_eof(c); break;
+    case OP_READ:  channel_read(c); break;
+    case OP_NONE:  break;
+    }
+    if(c && c->released && c != m_blocked_conn) {
+        retire(c);
+    }
+    return m_blocked_op == OP_NONE && !m_lost;
+}
 
-    std::string port = std::to_string(m_bastion_port);
+bool
+ssh_manager::bastion_transport::service_io(const connection_ptr& c)
+{
+    bool progress = false;
 
-    int err = getaddrinfo(m_bastion_host.c_str(), port.c_str(), &hints, &addrs);
-    if (err == 0) {
-        for(struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
-            sd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-            if (sd == -1) {
-                break; 
+    // local client -> channel
+    while(!c->client_eof && c->to_channel.writable() > 0) {
+        char* buf = c->to_channel.write_ptr();
+        // read() rather than recv(), the client may be a pipe.
+        ssize_t len = read(c->forwardsock, buf, c->to_channel.write_size());
+        if(len < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
             }
+            PLOGE << "read: " << strerror(errno);
+            c->error = std::string("read: ") + strerror(errno);
+            c->failed = true;
+            return progress;
+        }
+        if(len == 0) {
+            PLOGV << "[tunnel] the client disconnected";
+            c->client_eof = true;
+            break;
+        }
+        c->to_channel.produced(len);
+        progress = true;
+    }
+    while(c->to_channel.readable() > 0) {
+        size_t size = std::min(c->to_channel.readable(), m_scheduler.allowance(m_config.profile));
+        if(size == 0) {
+            // the reactor comes back once the scheduler has tokens again.
+            m_throttled = true;
+            break;
+        }
+        if(!channel_write(c, size)) {
+            break;
+        }
+        progress = true;
+    }
+    if(m_blocked_op != OP_NONE || m_lost || c->failed) {
+        return progress;
+    }
+    if(c->client_eof && !c->eof_sent && c->to_channel.readable() == 0) {
+        progress |= send_eof(c);
+        if(m_blocked_op != OP_NONE || m_lost || c->failed) {
+            return progress;
+        }
+    }
 
-            if (connect(sd, addr->ai_addr, addr->ai_addrlen) == 0) {
+    // channel -> local client
+    while(!c->channel_eof && c->to_client.writable() > 0 && channel_read(c)) {
+        progress = true;
+    }
+    while(c->to_client.readable() > 0) {
+        ssize_t wr = c->outsock != -1 ? 
+                     write(c->outsock, c->to_client.read_ptr(), c->to_client.readable()) :
+                     send(c->forwardsock, c->to_client.read_ptr(), c->to_client.readable(), SEND_FLAGS);
+        if(wr < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                if(errno != EINTR && c->metrics) {
+                    ++c->metrics->client_stalls;
+                }
                 break;
             }
+            PLOGE << "write: " << strerror(errno);
+            c->error = std::string("write: ") + strerror(errno);
+            c->failed = true;
+            return progress;
+        }
+        c->to_client.consumed(wr);
+        c->bytes_in += wr;
+        if(c->metrics) {
+            c->metrics->bytes_in += wr;
+        }
+        progress = true;
+    }
+    return progress;
+}
+
+bool
+ssh_manager::bastion_transport::service()
+{
+    if(m_state != READY) {
+        return true;
+    }
+    m_block_directions = 0;
+    m_throttled = false;
+    if(m_blocked_op != OP_NONE && !resume_blocked()) {
+        return !m_lost;
+    }
 
-            close(sd);
-            sd = -1;
+    // the passes are repeated until nothing moves anymore: libssh2 buffers
+    // what it reads from the socket for all the channels and handles window
+    // adjustments while reading, so progress on one channel may unblock
+    // another one without the socket ever being reported by the poll again.
+    bool progress = true;
+    while(progress && m_blocked_op == OP_NONE && !m_lost) {
+        progress = free_channels();
+        progress |= open_channels();
+        auto it = m_connections.begin();
+        while(it != m_connections.end() && m_blocked_op == OP_NONE && !m_lost) {
+            connection_ptr c = *it++;
+            if(c->channel && !c->failed) {
+                progress |= service_io(c);
+            }
+            // over once the server side is done and everything it sent is
+            // delivered, or on error.
+            if(c->failed || (c->channel && c->channel_eof && c->to_client.readable() == 0)) {
+                if(c != m_blocked_conn) {
+                    if(c->failed && c->metrics) {
+                        ++c->metrics->connections_failed;
+                    }
+                    release(c);
+                    // its channel gets freed on the next pass.
+                    progress = true;
+                }
+            }
         }
-    } else {
-        PLOGE << "[bastion] error: failed to get address to bastion: " << strerror(err);
     }
+    return !m_lost;
+}
 
-    freeaddrinfo(addrs);
+ssh_manager::ssh_tunnel::ssh_tunnel(uint64_t id, const tunnel_config& config)
+  : m_id(id),
+    m_config(config),
+    m_local_port(-1),
+    m_listen_sock(-1),
+    m_metrics(std::make_shared<tunnel_metrics>())
+{}
 
-    return sd;
+ssh_manager::ssh_tunnel::~ssh_tunnel()
+{
+    stop();
 }
 
 bool
@@ -102,7 +1136,7 @@ ssh_manager::ssh_tunnel::setup_listening_socket()
 {
     struct sockaddr_in serv_addr;
 
-    for (m_local_port = m_local_port_range.first; m_local_port <= m_local_port_range.second; ++m_local_port) {
+    for (m_local_port = m_config.local_port_range.first; m_local_port <= m_config.local_port_range.second; ++m_local_port) {
         m_listen_sock = socket(AF_INET, SOCK_STREAM, 0);
         if (m_listen_sock < 0) {
             std::cerr << "[tunnel] error: opening socket." << std::endl;
@@ -112,7 +1146,7 @@ ssh_manager::ssh_tunnel::setup_listening_socket()
         setsockopt(m_listen_sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
         memset(&serv_addr, 0, sizeof(serv_addr));
         serv_addr.sin_family = AF_INET;
-        serv_addr.sin_addr.s_addr = inet_addr(m_local_host.c_str());
+        serv_addr.sin_addr.s_addr = inet_addr(m_config.local_host.c_str());
         serv_addr.sin_port = htons(m_local_port);
 
 
@@ -121,15 +1155,17 @@ ssh_manager::ssh_tunnel::setup_listening_socket()
             close(m_listen_sock);
             continue;
         }
-        if(-1 == listen(m_listen_sock, 2)) {
+        if(-1 == listen(m_listen_sock, SOMAXCONN)) {
             PLOGE << "[tunnel] trying to listen: " << strerror(errno);
             close(m_listen_sock);
             continue;
         }
+        set_non_blocking(m_listen_sock);
         PLOGV << "[tunnel] server listening on port " << m_local_port << std::endl;
         return true;
     }
-    return false;    
+    m_listen_sock = -1;
+    return false;
 }
 
 ssh_manager::ssh_tunnel_ret
@@ -138,269 +1174,448 @@ ssh_manager::ssh_tunnel::start()
     if(setup_listening_socket() == false ) {
         return ssh_tunnel_ret(false);
     }
-    m_thread = std::thread([this]() {
-        while( m_should_stop == false ) {
-            bool result = run();
-            if(result == false) {
-                PLOGE << "[tunnel] error: tunnel thread failed";
-                break;
-            }
-        };
-    });
-    return ssh_tunnel_ret(true, m_local_port, m_dest_host); 
+    return ssh_tunnel_ret(true, m_local_port, m_config.dest_host);
 }
 
-void 
+void
 ssh_manager::ssh_tunnel::stop()
 {
-    m_should_stop = true;
-    close(m_listen_sock);
-    for (auto& os : m_all_sessions) {
-        close(os.forwardsock);
-        if(os.channel) {
-            libssh2_channel_free(os.channel);
+    if(m_listen_sock != -1) {
+        close(m_listen_sock);
+        m_listen_sock = -1;
+    }
+}
+
+ssh_manager::connection_ptr
+ssh_manager::ssh_tunnel::accept_connection(connection_pool& pool)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    int forwardsock = accept(m_listen_sock, (struct sockaddr *)&sin, &sinlen);
+    if(forwardsock == -1) {
+        if(errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+            PLOGE << "accept: " << strerror(errno);
         }
-        libssh2_session_disconnect(os.session, "");
-        libssh2_session_free(os.session);
-        close(os.sock); 
-        os.io_thread.join();
+        return nullptr;
     }
-    m_all_sessions.clear();
-    m_thread.join();
+    set_non_blocking(forwardsock);
+    tune_socket(forwardsock, 0);
+    auto c = pool.acquire();
+    c->tunnel_id = m_id;
+    c->dest_host = m_config.dest_host;
+    c->dest_port = m_config.dest_port;
+    c->forwardsock = forwardsock;
+    c->src_host = inet_ntoa(sin.sin_addr);
+    c->src_port = ntohs(sin.sin_port);
+    c->metrics = m_metrics;
+    c->accepted = clock::now();
+    ++m_metrics->connections_total;
+    return c;
 }
 
-bool
-ssh_manager::ssh_tunnel::establish_connection_to_bastion(one_session& os)
-{    
-    // Connect to SSH server 
-    os.sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 
-    if(os.sock == -1) { 
-        PLOGE << "[bastion] error: failed to create a socket!";
-        return false;
+ssh_manager::ssh_manager()
+  : ssh_manager(BASTION_SSH_HOSTNAME, BASTION_SSH_PORT)
+{}
+
+ssh_manager::ssh_manager(const std::string& bastion_host, unsigned int bastion_port)
+  : m_bastion_host(bastion_host),
+    m_bastion_port(bastion_port)
+{
+    int rc = libssh2_init(0);
+    if(rc) {
+        PLOGV << "Error: libssh2 initialization failed: " << rc;
     }
-    os.sock = connect_to_bastion();
-    if(os.sock == -1) {
-        PLOGE << "[bastion] error: failed to connect to bastion: " << strerror(errno);
-        return false;
+    if(pipe(m_wakeup_pipe) == -1) {
+        PLOGE << "[tunnel] error: failed to create the reactor wakeup pipe: " << strerror(errno);
     }
-    // Create a session instance 
-    os.session = libssh2_session_init();
+    set_non_blocking(m_wakeup_pipe[0]);
+    set_non_blocking(m_wakeup_pipe[1]);
+    m_reactor = std::thread([this]() {
+        reactor_loop();
+    });
+}
 
-    if(!os.session) {
-        PLOGE << "[bastion] error: could not initialize SSH session!";
-        return false;
-    }
-    // Start it up. This will trade welcome banners, exchange keys,
-    // and setup crypto, compression, and MAC layers
-    int rc = libssh2_session_handshake(os.session, os.sock);
+ssh_manager::~ssh_manager()
+{
+    post([this]() {
+        for(auto& tit : m_session_tunnels) {
+            PLOGV << "Stopping ssh tunnel for session \'" << tit.first << "\'... ";
+            tit.second->stop();
+            PLOGV << "done.";
+        }
+        m_session_tunnels.clear();
+        m_transports.clear();
+        m_should_stop = true;
+    });
+    m_reactor.join();
+    // the transport setups still in progress are waited for, canceled so
+    // that they don't sit out their connect timeout or a hanging handshake.
+    m_setup_canceler.cancel();
+    m_setups.clear();
+    m_tasks.clear();
+    close(m_wakeup_pipe[0]);
+    close(m_wakeup_pipe[1]);
+    libssh2_exit();
+}
 
-    if(rc) {
-        PLOGE << "[bastion] error: failed to start up SSH session: " << rc;
-        return false;
+void
+ssh_manager::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_tasks_mutex);
+        m_tasks.push_back(std::move(task));
     }
-
-    if(libssh2_userauth_publickey_fromfile(os.session, 
-                                           m_username.c_str(), 
-                                           m_bastion_public_key.c_str(), 
-                                           m_bastion_private_key.c_str(), 
-                                           "")) {
-        PLOGE << "[bastion] error: authentication by private key failed!";
-        return false;
+    char c = 0;
+    if(write(m_wakeup_pipe[1], &c, 1) == -1 && errno != EAGAIN) {
+        PLOGE << "[tunnel] error: failed to wake up the reactor: " << strerror(errno);
     }
-    PLOGV << "[bastion] authentication  by private key is succeeded!";
-    
-    return true;
 }
 
-bool 
-ssh_manager::ssh_tunnel::run()
-{    
-    one_session os;
-    struct sockaddr_in sin;
-    socklen_t sinlen = sizeof(sin);
+void
+ssh_manager::run_on_reactor(const std::function<void()>& task)
+{
+    std::promise<void> done;
+    auto future = done.get_future();
+    post([&task, &done]() {
+        task();
+        done.set_value();
+    });
+    future.wait();
+}
 
-    fd_set allset;
-    struct timeval tv;
-    tv.tv_sec = 0; 
-    tv.tv_usec = 100000;	
+void
+ssh_manager::run_posted_tasks()
+{
+    char buf[64];
+    while(read(m_wakeup_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> guard(m_tasks_mutex);
+        tasks.swap(m_tasks);
+    }
+    for(auto& task : tasks) {
+        task();
+    }
+    m_setups.remove_if([](const std::future<void>& f) {
+        return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+}
 
+ssh_manager::bastion_transport&
+ssh_manager::transport_for(const tunnel_config& config)
+{
+    auto& transport = m_transports[bastion_transport::key_of(config)];
+    if(!transport) {
+        transport = std::make_unique<bastion_transport>(config, m_scheduler);
+    }
+    return *transport;
+}
 
-    while(m_should_stop == false) {    
-        FD_ZERO(&allset);
-        FD_SET(m_listen_sock, &allset);
-        int max_fd = m_listen_sock;
+void
+ssh_manager::connect_transport(bastion_transport& transport)
+{
+    // the ssh handshake blocks, it's done on the side and the
+    // authenticated session is handed back to the reactor.
+    const uint64_t generation = transport.begin_connect();
+    const tunnel_config config = transport.config();
+    const std::string key = bastion_transport::key_of(config);
+    PLOGV << "[bastion] connecting transport " << key;
+    m_setups.push_back(std::async(std::launch::async, [this, key, generation, config]() {
+        std::string error;
+        auto session = bastion_transport::establish(config, m_setup_canceler, error);
+        post([this, key, generation, session, error]() {
+            auto fit = m_transports.find(key);
+            if(fit == m_transports.end()) {
+                // all the tunnels of the user are gone in the meantime.
+                return;
+            }
+            bastion_transport& transport = *fit->second;
+            transport.adopt(generation, session, error);
+            if(transport.state() == bastion_transport::DISCONNECTED && transport_in_use(key)) {
+                // the listening sockets stay, the tunnels get a session
+                // again once the bastion is back.
+                transport.schedule_retry(clock::now());
+            }
+            service_transport(transport);
+        });
+    }));
+}
 
-        int activity = select(max_fd + 1, &allset, nullptr, nullptr, &tv);
+void
+ssh_manager::service_transport(bastion_transport& transport)
+{
+    if(transport.service()) {
+        return;
+    }
+    // the session dropped, the connections waiting for a channel are
+    // carried over to a new one.
+    PLOGW << "[bastion] transport " << bastion_transport::key_of(transport.config())
+          << " is lost, reconnecting";
+    transport.disconnect();
+    connect_transport(transport);
+}
 
-        if (activity < 0 && errno != EINTR) {
-            PLOGE << "select: " << strerror(errno);
-            break;
-        }
+void
+ssh_manager::accept_connections(ssh_tunnel& tunnel)
+{
+    bastion_transport& transport = transport_for(tunnel.config());
+    bool accepted = false;
+    while(auto c = tunnel.accept_connection(transport.pool())) {
+        transport.connections().push_back(c);
+        accepted = true;
+    }
+    if(!accepted) {
+        return;
+    }
+    if(transport.state() == bastion_transport::DISCONNECTED) {
+        connect_transport(transport);
+    } else {
+        service_transport(transport);
+    }
+}
 
-        if (activity == 0) {
-            // Timeout, no activity
-            continue;
+bool
+ssh_manager::transport_in_use(const std::string& key) const
+{
+    for(const auto& tit : m_session_tunnels) {
+        if(bastion_transport::key_of(tit.second->config()) == key) {
+            return true;
         }
+    }
+    return false;
+}
 
-        if (FD_ISSET(m_listen_sock, &allset)) {
-            os.forwardsock = accept(m_listen_sock, (struct sockaddr *)&sin, &sinlen);
-
-            if(os.forwardsock < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                continue;
-            }
-            if(os.forwardsock == -1) {
-                PLOGE << "accept: " << strerror(errno);
-                return false;
-            }
-            const char *src_host = inet_ntoa(sin.sin_addr);
-            unsigned int src_port = ntohs(sin.sin_port);
-        
-            if(os.channel) {
-                libssh2_channel_free(os.channel);
-                os.channel = NULL;
-                return false;
-            }   
-            if(establish_connection_to_bastion(os) == false) {
-                return false;
-            }
-            PLOGV << "[host] trying to create a channel, dest " << m_dest_host << ":" << m_dest_port
-                  << ", src " << src_host << ":"<<src_port;
-            os.channel = libssh2_channel_direct_tcpip_ex(os.session, 
-                                                         m_dest_host.c_str(), m_dest_port, 
-                                                         src_host, src_port);
-            if(!os.channel) {
-                PLOGE << "[host] error: libssh2_channel_direct_tcpip_ex, failed to create a channel...";
-                return false;
-            }
-            break;
+int
+ssh_manager::run_timers()
+{
+    auto now = clock::now();
+    auto next = clock::time_point::max();
+    for(auto& trit : m_transports) {
+        bastion_transport& transport = *trit.second;
+        const tunnel_profile profile = transport.config().profile;
+        if(!transport.keepalive(now)) {
+            service_transport(transport);
+        } else
+        if(transport.retry_due(now)) {
+            connect_transport(transport);
+        } else
+        if(transport.throttled() && now >= m_scheduler.next_refill(profile)) {
+            service_transport(transport);
+        }
+        next = std::min(next, transport.next_timer());
+        if(transport.throttled()) {
+            next = std::min(next, m_scheduler.next_refill(profile));
         }
     }
-    
-    if(m_should_stop == false) {
-        m_all_sessions.push_back(std::move(os));
-        one_session& ros = m_all_sessions.back();
-        ros.io_thread = std::thread([this, &ros]() {
-            service_io(ros);
-        });
+    if(next == clock::time_point::max()) {
+        return -1;
     }
-    return true; 
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+    // rounded up, an early wakeup would find nothing due.
+    return int(std::max<int64_t>(wait + 1, 0));
 }
 
+void
+ssh_manager::retire_tunnel(ssh_tunnel& tunnel)
+{
+    tunnel.stop();
+    const std::string key = bastion_transport::key_of(tunnel.config());
+    auto fit = m_transports.find(key);
+    if(fit == m_transports.end()) {
+        return;
+    }
+    bastion_transport& transport = *fit->second;
+    std::vector<connection_ptr> connections;
+    for(auto& c : transport.connections()) {
+        if(c->tunnel_id == tunnel.id()) {
+            connections.push_back(c);
+        }
+    }
+    for(auto& c : connections) {
+        transport.release(c);
+    }
+    for(const auto& tit : m_session_tunnels) {
+        if(tit.second.get() != &tunnel && 
+           bastion_transport::key_of(tit.second->config()) == key) {
+            // still used by another tunnel, the closed channels are freed
+            // on the next service round.
+            service_transport(transport);
+            return;
+        }
+    }
+    m_transports.erase(fit);
+}
 
-bool 
-ssh_manager::ssh_tunnel::service_io(one_session& os)
+void
+ssh_manager::sample_rates(bool force)
 {
-    // must use non-blocking IO hereafter due to the current libssh2 API  
-    libssh2_session_set_blocking(os.session, 0);
+    auto now = clock::now();
+    if(!force && now - m_last_sample < std::chrono::seconds(1)) {
+        return;
+    }
+    m_last_sample = now;
+    for(auto& tit : m_session_tunnels) {
+        tunnel_metrics& metrics = tit.second->metrics();
+        metrics.rate_out.sample(metrics.bytes_out, now);
+        metrics.rate_in.sample(metrics.bytes_in, now);
+    }
+}
 
-    fd_set fds;
-    char buf[16384];
-    struct timeval tv;
+void
+ssh_manager::reactor_loop()
+{
+    // what each polled descriptor belongs to, the events of local sockets
+    // and bastion sockets alike are served by the transport.
+    struct poll_target
+    {
+        ssh_tunnel* tunnel;
+        bastion_transport* transport;
+    };
+    std::vector<struct pollfd> fds;
+    std::vector<poll_target> targets;
+    std::vector<bastion_transport*> ready;
 
-    while( true && m_should_stop == false) {
-        FD_ZERO(&fds);
-        FD_SET(os.forwardsock, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        int rc = select(os.forwardsock + 1, &fds, NULL, NULL, &tv);
-        if(-1 == rc) {
-            PLOGE << "select: " << strerror(errno);
-            return false;
+    while(m_should_stop == false) {
+        int timeout = run_timers();
+        fds.clear();
+        targets.clear();
+        fds.push_back({m_wakeup_pipe[0], POLLIN, 0});
+        targets.push_back({nullptr, nullptr});
+        for(auto& tit : m_session_tunnels) {
+            ssh_tunnel& tunnel = *tit.second;
+            fds.push_back({tunnel.listen_sock(), POLLIN, 0});
+            targets.push_back({&tunnel, nullptr});
         }
-        if(rc && FD_ISSET(os.forwardsock, &fds)) {
-            ssize_t len = recv(os.forwardsock, buf, sizeof(buf), 0);
-            if(len < 0) {
-                PLOGE << "read: " << strerror(errno);
-                return false;
-            }
-            else if(0 == len) {
-                PLOGV << "[tunnel] the client disconnected" << std::endl; 
-                return true;
-            }
-            ssize_t wr = 0;
-            while((wr < len)  && m_should_stop == false)  {
-                int i = libssh2_channel_write(os.channel, buf + wr, len - wr);
-
-                if(LIBSSH2_ERROR_EAGAIN == i) {
-                    continue;
+        for(auto& trit : m_transports) {
+            bastion_transport& transport = *trit.second;
+            // polled with no events as well, for the errors.
+            fds.push_back({transport.sock(), transport.poll_events(), 0});
+            targets.push_back({nullptr, &transport});
+            for(auto& c : transport.connections()) {
+                short client_events = 0;
+                if(c->channel) {
+                    if(!c->client_eof && c->to_channel.writable() > 0) {
+                        client_events |= POLLIN;
+                    }
+                    if(c->to_client.readable() > 0) {
+                        client_events |= POLLOUT;
+                    }
                 }
-                if(i < 0) {
-                    PLOGE << "[tunnel] error: libssh2_channel_write: "<< i << std::endl;
-                    return false;
+                // a socket with nothing to wait for is left out, a hung up 
+                // client would wake up the poll otherwise.
+                if(c->outsock == -1) {
+                    fds.push_back({client_events ? c->forwardsock : -1, client_events, 0});
+                    targets.push_back({nullptr, &transport});
+                    continue;
                 }
-                wr += i;
+                // a stdio client reads and writes on separate descriptors.
+                short in_events = client_events & POLLIN;
+                short out_events = client_events & POLLOUT;
+                fds.push_back({in_events ? c->forwardsock : -1, in_events, 0});
+                targets.push_back({nullptr, &transport});
+                fds.push_back({out_events ? c->outsock : -1, out_events, 0});
+                targets.push_back({nullptr, &transport});
             }
         }
-        while( m_should_stop == false) {
-            ssize_t len = libssh2_channel_read(os.channel, buf, sizeof(buf));
 
-            if(LIBSSH2_ERROR_EAGAIN == len)
-                break;
-            else if(len < 0) {
-                PLOGE << "[tunnel] error: libssh2_channel_read: " << (int)len;
-                return false;
+        int activity = poll(fds.data(), fds.size(), timeout);
+        if(activity < 0) {
+            if(errno == EINTR) {
+                continue;
             }
-            ssize_t wr = 0;
-            while((wr < len) && m_should_stop == false) {
-                int i = send(os.forwardsock, buf + wr, len - wr, 0);
-                if(i <= 0) {
-                    PLOGE << "write: " << strerror(errno);
-                    return false;
-                }
-                wr += i;
+            PLOGE << "poll: " << strerror(errno);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        // the channels share the session, so a transport is serviced as a
+        // whole and once per round.
+        ready.clear();
+        for(size_t i = 1; i < fds.size(); ++i) {
+            if(fds[i].revents == 0) {
+                continue;
+            }
+            if(targets[i].tunnel) {
+                accept_connections(*targets[i].tunnel);
+                continue;
+            }
+            if(fds[i].fd == targets[i].transport->sock() && 
+               (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                targets[i].transport->socket_failed();
             }
-            if(libssh2_channel_eof(os.channel)) {
-                PLOGV << "[tunnel] the server disconnected";
-                return true;
+            if(std::find(ready.begin(), ready.end(), targets[i].transport) == ready.end()) {
+                ready.push_back(targets[i].transport);
             }
         }
-    }
-    return true;
-}
-
-
-
-
-ssh_manager::ssh_manager()
-{
-    int rc = libssh2_init(0);
-    if(rc) {
-        PLOGV << "Error: libssh2 initialization failed: " << rc;
+        // interactive transports go first, their writes get ahead of the
+        // bulk ones in the round. That's all it does, the sessions have
+        // their own sockets; the bulk_yield cap keeps the link free.
+        std::stable_sort(ready.begin(), ready.end(), 
+                         [](const bastion_transport* a, const bastion_transport* b) {
+                             return a->config().profile == INTERACTIVE && b->config().profile != INTERACTIVE;
+                         });
+        for(auto transport : ready) {
+            service_transport(*transport);
+        }
+        sample_rates(false);
+        // tasks may add or drop tunnels, so they go last.
+        if(fds[0].revents) {
+            run_posted_tasks();
+        }
     }
 }
 
-ssh_manager::~ssh_manager()
+ssh_manager::tunnel_config
+ssh_manager::make_config(const std::string& bastion_username,
+                         const std::string& bastion_key_file,
+                         const std::string& desthost,
+                         unsigned int destport,
+                         tunnel_profile profile) const
 {
-    for(auto& tit : m_session_tunnels) {
-        PLOGV << "Stopping ssh tunnel for session \'" << tit.first << "\'... ";        
-        tit.second->stop();
-        PLOGV << "done.";
-    }
-    libssh2_exit();
+    tunnel_config config;
+    config.username = bastion_username;
+    config.bastion_public_key = bastion_key_file + ".pub";
+    config.bastion_private_key = bastion_key_file;
+    config.local_host = LOCAL_SSH_HOSTNAME;
+    config.local_port_range = std::make_pair(LOCAL_SSH_PORT_START, LOCAL_SSH_PORT_START+1000);
+    config.bastion_host = m_bastion_host;
+    config.bastion_port = m_bastion_port;
+    config.dest_host = desthost;
+    config.dest_port = destport;
+    config.profile = profile;
+    return config;
 }
 
-ssh_manager::ssh_tunnel_ret 
+ssh_manager::ssh_tunnel_ret
 ssh_manager::start_ssh_tunnel(const std::string& session_name,
                               const std::string& bastion_username,
                               const std::string& bastion_key_file,
                               const std::string& desthost,
-                              const unsigned int destport)
+                              const unsigned int destport,
+                              tunnel_profile profile)
 {
     PLOGV << "Starting ssh tunnel for session \'" << session_name << "\'... ";
-    auto tunnel = std::make_unique<ssh_tunnel>(bastion_username, 
-                                               bastion_key_file + ".pub",
-                                               bastion_key_file,
-                                               LOCAL_SSH_HOSTNAME,
-                                               std::make_pair(LOCAL_SSH_PORT_START, LOCAL_SSH_PORT_START+1000),
-                                               BASTION_SSH_HOSTNAME,
-                                               BASTION_SSH_PORT,                                               
-                                               desthost, 
-                                               destport);
+    const tunnel_config config = make_config(bastion_username, bastion_key_file, 
+                                             desthost, destport, profile);
+    auto tunnel = std::make_unique<ssh_tunnel>(++m_tunnel_seq, config);
     auto tunnel_ret = tunnel->start();
     if(tunnel_ret.status) {
-        m_session_tunnels.insert(std::make_pair(session_name, std::move(tunnel)));
+        run_on_reactor([&]() {
+            // a tunnel of the same name is replaced.
+            auto& slot = m_session_tunnels[session_name];
+            auto replaced = std::move(slot);
+            slot = std::move(tunnel);
+            if(replaced) {
+                retire_tunnel(*replaced);
+            }
+            // warm up the session, the first connection doesn't wait for it.
+            auto& transport = transport_for(config);
+            if(transport.state() == bastion_transport::DISCONNECTED) {
+                connect_transport(transport);
+            }
+        });
     }
     return tunnel_ret;
 }
@@ -408,13 +1623,143 @@ ssh_manager::start_ssh_tunnel(const std::string& session_name,
 void
 ssh_manager::stop_ssh_tunnel(const std::string& name)
 {
-    auto fit = m_session_tunnels.find(name);
-    if(fit != m_session_tunnels.end()) {
-        PLOGV << "Stopping ssh tunnel for session \'" << name << "\'... ";
-        fit->second->stop();
-        m_session_tunnels.erase(fit);
-        PLOGV << "done.";
-    }
+    run_on_reactor([&]() {
+        auto fit = m_session_tunnels.find(name);
+        if(fit != m_session_tunnels.end()) {
+            PLOGV << "Stopping ssh tunnel for session \'" << name << "\'... ";
+            retire_tunnel(*fit->second);
+            m_session_tunnels.erase(fit);
+            PLOGV << "done.";
+        }
+    });
+}
+
+std::vector<ssh_manager::tunnel_stats>
+ssh_manager::tunnel_statistics()
+{
+    std::vector<tunnel_stats> stats;
+    run_on_reactor([&]() {
+        sample_rates(true);
+        const auto now = clock::now();
+        for(const auto& tit : m_session_tunnels) {
+            const ssh_tunnel& tunnel = *tit.second;
+            const tunnel_metrics& metrics = tunnel.metrics();
+            tunnel_stats ts;
+            ts.name = tit.first;
+            ts.transport = bastion_transport::key_of(tunnel.config());
+            ts.local_port = tunnel.local_port();
+            ts.dest_host = tunnel.config().dest_host;
+            ts.dest_port = tunnel.config().dest_port;
+            ts.bytes_out = metrics.bytes_out;
+            ts.bytes_in = metrics.bytes_in;
+            ts.rate_out = metrics.rate_out.rate();
+            ts.rate_in = metrics.rate_in.rate();
+            ts.channel_stalls = metrics.channel_stalls;
+            ts.client_stalls = metrics.client_stalls;
+            ts.connections_total = metrics.connections_total;
+            ts.connections_failed = metrics.connections_failed;
+            if(metrics.channel_opens) {
+                ts.channel_open_ms = metrics.channel_open_ms / metrics.channel_opens;
+            }
+            ts.transport_state = "disconnected";
+            auto fit = m_transports.find(ts.transport);
+            if(fit != m_transports.end()) {
+                bastion_transport& transport = *fit->second;
+                if(transport.state() == bastion_transport::CONNECTING) {
+                    ts.transport_state = "connecting";
+                } else
+                if(transport.state() == bastion_transport::READY) {
+                    ts.transport_state = "ready";
+                }
+                ts.sessions = transport.sessions();
+                if(auto session = transport.last_session()) {
+                    ts.tcp_connect_ms = session->connect_ms;
+                    ts.handshake_ms = session->handshake_ms;
+                    ts.auth_ms = session->auth_ms;
+                }
+                for(const auto& c : transport.connections()) {
+                    if(c->tunnel_id != tunnel.id()) {
+                        continue;
+                    }
+                    connection_stats cs;
+                    cs.source = c->src_host + ":" + std::to_string(c->src_port);
+                    cs.bytes_out = c->bytes_out;
+                    cs.bytes_in = c->bytes_in;
+                    cs.channel_open_ms = c->channel ? c->channel_open_ms : 0;
+                    cs.age_s = std::chrono::duration<double>(now - c->accepted).count();
+                    ts.connections.push_back(cs);
+                }
+            }
+            ts.connections_active = ts.connections.size();
+            stats.push_back(std::move(ts));
+        }
+    });
+    return stats;
+}
+
+void
+ssh_manager::set_bandwidth_caps(const bandwidth_caps& caps)
+{
+    run_on_reactor([&]() {
+        m_scheduler.set_caps(caps);
+        // the throttled transports may go on right away.
+        for(auto& trit : m_transports) {
+            if(trit.second->throttled()) {
+                service_transport(*trit.second);
+            }
+        }
+    });
+}
+
+ssh_manager::bandwidth_caps
+ssh_manager::current_bandwidth_caps()
+{
+    bandwidth_caps caps;
+    run_on_reactor([&]() {
+        caps = m_scheduler.caps();
+    });
+    return caps;
+}
+
+std::string
+ssh_manager::run_stdio_proxy(const std::string& bastion_username,
+                             const std::string& bastion_key_file,
+                             const std::string& desthost,
+                             const unsigned int destport,
+                             tunnel_profile profile,
+                             int in_fd, int out_fd)
+{
+    PLOGV << "Starting stdio proxy to " << desthost << ":" << destport << "... ";
+    const tunnel_config config = make_config(bastion_username, bastion_key_file, 
+                                             desthost, destport, profile);
+    std::promise<std::string> finished;
+    auto done = finished.get_future();
+    run_on_reactor([&]() {
+        // a connection of no tunnel, the descriptors take the place of
+        // an accepted socket.
+        bastion_transport& transport = transport_for(config);
+        auto c = transport.pool().acquire();
+        c->dest_host = desthost;
+        c->dest_port = destport;
+        set_non_blocking(in_fd);
+        set_non_blocking(out_fd);
+        c->forwardsock = in_fd;
+        c->outsock = out_fd;
+        c->src_host = LOCAL_SSH_HOSTNAME;
+        c->accepted = clock::now();
+        c->on_finished = [&finished](const std::string& error) {
+            finished.set_value(error);
+        };
+        transport.connections().push_back(c);
+        if(transport.state() == bastion_transport::DISCONNECTED) {
+            connect_transport(transport);
+        } else {
+            service_transport(transport);
+        }
+    });
+    auto error = done.get();
+    PLOGV << "stdio proxy is done" << (error.empty() ? "." : ": " + error);
+    return error;
 }
 
 } // namespace metriffic
@@ -8,14 +8,21 @@
 #include <memory>
 #include <map>
 #include <list>
+#include <set>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <chrono>
 
 namespace metriffic
 {
 
 class ssh_manager
-{ 
+{
 public:
-    struct ssh_tunnel_ret 
+    struct ssh_tunnel_ret
     {
         ssh_tunnel_ret(bool s = false, unsigned int p = -1, const std::string& host = "")
          : status(s), local_port(p), dest_host(host)
@@ -25,93 +32,522 @@ public:
         const std::string dest_host;
     };
 
-private:   
-    class ssh_tunnel
+    // how the connections of a tunnel are tuned: interactive ones for
+    // latency, bulk ones (rsync) for throughput over high-RTT links. Each
+    // profile of a user gets its own bastion session.
+    enum tunnel_profile { INTERACTIVE, BULK };
+
+    // what a connection of a tunnel moved so far, "out" is towards the
+    // bastion.
+    struct connection_stats
+    {
+        std::string source;
+        uint64_t bytes_out = 0;
+        uint64_t bytes_in = 0;
+        // 0 while it waits for its channel.
+        double channel_open_ms = 0;
+        double age_s = 0;
+    };
+
+    struct tunnel_stats
+    {
+        std::string name;
+        std::string transport;
+        std::string transport_state;
+        unsigned int local_port = 0;
+        std::string dest_host;
+        unsigned int dest_port = 0;
+        uint64_t bytes_out = 0;
+        uint64_t bytes_in = 0;
+        // moving averages, in bytes per second.
+        double rate_out = 0;
+        double rate_in = 0;
+        // channel writes hitting EAGAIN mean the bastion or the board
+        // doesn't keep up, client writes hitting it mean the local side.
+        uint64_t channel_stalls = 0;
+        uint64_t client_stalls = 0;
+        size_t connections_active = 0;
+        uint64_t connections_total = 0;
+        uint64_t connections_failed = 0;
+        // setup of the current (or last) bastion session, in ms.
+        double tcp_connect_ms = 0;
+        double handshake_ms = 0;
+        double auth_ms = 0;
+        // sessions established so far, more than one on reconnects.
+        uint64_t sessions = 0;
+        // average over the channels opened so far.
+        double channel_open_ms = 0;
+        std::vector<connection_stats> connections;
+    };
+
+    // uplink caps in bytes per second, 0 for none. The bulk tunnels are
+    // held to bulk_yield while interactive traffic is flowing, so their
+    // data doesn't queue up in front of the keystrokes. The two classes
+    // run on separate bastion sessions, only this cap makes the bulk one
+    // give way, so it's on by default.
+    struct bandwidth_caps
+    {
+        uint64_t interactive = 0;
+        uint64_t bulk = 0;
+        uint64_t bulk_yield = 1024 * 1024;
+    };
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    // shares the uplink between the tunnel classes: writes to the channels
+    // of a class go through its token bucket. Reactor thread only.
+    class bandwidth_scheduler
     {
     public:
-        struct one_session {
-            one_session();
-            LIBSSH2_SESSION* session;
-            LIBSSH2_CHANNEL* channel;
-            int sock;
-            int forwardsock;
-            std::thread io_thread;
+        void set_caps(const bandwidth_caps& caps);
+        const bandwidth_caps& caps() const { return m_caps; }
+        // bytes the class may write now, 0 if it has to wait for tokens.
+        size_t allowance(tunnel_profile profile);
+        void consumed(tunnel_profile profile, size_t n);
+        // when a throttled class can write again.
+        clock::time_point next_refill(tunnel_profile profile) const;
+
+    private:
+        struct bucket
+        {
+            uint64_t rate = 0;
+            double tokens = 0;
+            clock::time_point last = clock::now();
         };
-        ssh_tunnel(const std::string& username,
-                   const std::string& bastion_public_key,
-                   const std::string& bastion_private_key,
-                   const std::string& local_host,
-                   std::pair<unsigned int, unsigned int> local_port_range,
-                   const std::string& bastion_host,
-                   const unsigned int bastion_port,
-                   const std::string& dest_host,
-                   const unsigned int dest_port);
+        uint64_t rate_of(tunnel_profile profile, clock::time_point now) const;
+        static double burst_of(uint64_t rate);
+        static double min_write_of(uint64_t rate);
+
+    private:
+        bandwidth_caps m_caps;
+        bucket m_buckets[2];
+        clock::time_point m_last_interactive;
+    };
+
+    // exponential moving average of the rate of a byte counter.
+    class rate_meter
+    {
+    public:
+        void sample(uint64_t total, clock::time_point now);
+        double rate() const { return m_rate; }
+
+    private:
+        double m_rate = 0;
+        uint64_t m_total = 0;
+        clock::time_point m_last = clock::now();
+    };
+
+    // counters of a tunnel, shared with its connections. Reactor thread only.
+    struct tunnel_metrics
+    {
+        uint64_t bytes_out = 0;
+        uint64_t bytes_in = 0;
+        uint64_t channel_stalls = 0;
+        uint64_t client_stalls = 0;
+        uint64_t connections_total = 0;
+        uint64_t connections_failed = 0;
+        uint64_t channel_opens = 0;
+        double channel_open_ms = 0;
+        rate_meter rate_out;
+        rate_meter rate_in;
+    };
+    typedef std::shared_ptr<tunnel_metrics> tunnel_metrics_ptr;
+
+    struct profile_settings
+    {
+        const char* name;
+        // channel receive window and max packet size. libssh2 rejects
+        // inbound packets above LIBSSH2_PACKET_MAXPAYLOAD, so the packet
+        // size can't go much beyond the 32 KB default.
+        unsigned int window_size;
+        unsigned int packet_size;
+        size_t io_buffer_size;
+        // SO_SNDBUF/SO_RCVBUF of the bastion socket, 0 leaves them to the
+        // kernel autotuning.
+        int socket_buffer_size;
+        // libssh2_session_method_pref lists, the handshake is retried with
+        // the libssh2 defaults if the bastion agrees on none of them.
+        const char* kex;
+        const char* ciphers;
+        const char* macs;
+    };
+    static const profile_settings& settings_of(tunnel_profile profile);
+
+    // bytes read from one side of a connection and not yet written to the other.
+    class io_buffer
+    {
+    public:
+        explicit io_buffer(size_t capacity);
+        void clear() { m_begin = m_end = 0; }
+        char* read_ptr() { return m_data.data() + m_begin; }
+        size_t readable() const { return m_end - m_begin; }
+        // where the next bytes go, write_size() of them fit there.
+        char* write_ptr();
+        size_t write_size() const { return m_data.size() - m_end; }
+        size_t writable() const { return m_data.size() - readable(); }
+        void produced(size_t n) { m_end += n; }
+        void consumed(size_t n);
+
+    private:
+        std::vector<char> m_data;
+        size_t m_begin = 0;
+        size_t m_end = 0;
+    };
+
+    struct tunnel_config
+    {
+        std::string username;
+        std::string bastion_public_key;
+        std::string bastion_private_key;
+        std::string local_host;
+        std::pair<unsigned int, unsigned int> local_port_range;
+        std::string bastion_host;
+        unsigned int bastion_port;
+        std::string dest_host;
+        unsigned int dest_port;
+        tunnel_profile profile;
+    };
+
+    // an accepted local connection forwarded through a channel of the
+    // bastion transport.
+    struct connection
+    {
+        explicit connection(size_t buffer_size);
+        ~connection();
+        connection(const connection&) = delete;
+        connection& operator=(const connection&) = delete;
+        // back to the state of a fresh record, the buffers are kept.
+        void reset();
+        void close_client();
+
+        uint64_t tunnel_id;
+        std::string dest_host;
+        unsigned int dest_port;
+        // null until the transport managed to open it.
+        LIBSSH2_CHANNEL* channel;
+        int forwardsock;
+        // set when the client writes go to another descriptor than the one
+        // it's read from (stdio proxy), -1 otherwise.
+        int outsock;
+        std::string src_host;
+        unsigned int src_port;
+        io_buffer to_channel;
+        io_buffer to_client;
+        bool client_eof = false;
+        bool eof_sent = false;
+        bool channel_eof = false;
+        bool failed = false;
+        bool released = false;
+        // why the connection ended early, empty if it didn't.
+        std::string error;
+        // called once the client side is closed, with the error.
+        std::function<void(const std::string&)> on_finished;
+
+        // the metrics of its tunnel, none for a stdio proxy.
+        tunnel_metrics_ptr metrics;
+        uint64_t bytes_out = 0;
+        uint64_t bytes_in = 0;
+        clock::time_point accepted;
+        clock::time_point open_started;
+        double channel_open_ms = 0;
+    };
+    typedef std::shared_ptr<connection> connection_ptr;
+
+    // finished connection records are kept for the next ones to reuse
+    // their buffers, up to a bound so an idle tunnel doesn't hold on to
+    // what a burst of connections needed.
+    class connection_pool
+    {
+    public:
+        explicit connection_pool(size_t buffer_size);
+        connection_ptr acquire();
+        void recycle(const connection_ptr& c);
+        size_t size() const { return m_free.size(); }
+
+    private:
+        static const size_t POOL_CAPACITY = 8;
+        const size_t m_buffer_size;
+        std::vector<connection_ptr> m_free;
+    };
+
+    // an authenticated ssh session to the bastion and its socket.
+    // lets the destructor cut the transport setups short instead of waiting
+    // for their connect timeout and blocking handshake.
+    class setup_canceler
+    {
+    public:
+        const std::atomic<bool>& canceled() const { return m_canceled; }
+        // the socket is shut down on cancel, false if that happened already.
+        bool track(int sock);
+        void untrack(int sock);
+        void cancel();
+
+    private:
+        std::mutex m_mutex;
+        std::set<int> m_sockets;
+        std::atomic<bool> m_canceled{false};
+    };
+
+    struct bastion_session
+    {
+        bastion_session() = default;
+        ~bastion_session();
+        bastion_session(const bastion_session&) = delete;
+        bastion_session& operator=(const bastion_session&) = delete;
+
+        LIBSSH2_SESSION* session = NULL;
+        int sock = -1;
+        // set while the session is being set up.
+        setup_canceler* canceler = nullptr;
+        // how long the setup steps took, in ms.
+        double connect_ms = 0;
+        double handshake_ms = 0;
+        double auth_ms = 0;
+    };
+    typedef std::shared_ptr<bastion_session> bastion_session_ptr;
+
+    // the single ssh session of a bastion user, every connection of all the
+    // tunnels of that user is a direct-tcpip channel on it. Lives on the
+    // reactor thread.
+    class bastion_transport
+    {
+    public:
+        enum state_t { DISCONNECTED, CONNECTING, READY };
+
+        bastion_transport(const tunnel_config& config, bandwidth_scheduler& scheduler);
+        ~bastion_transport();
+
+        static std::string key_of(const tunnel_config& config);
+        const tunnel_config& config() const { return m_config; }
+        state_t state() const { return m_state; }
+        int sock() const { return m_session ? m_session->sock : -1; }
+        short poll_events() const;
+        std::list<connection_ptr>& connections() { return m_connections; }
+        connection_pool& pool() { return m_pool; }
+        // the session of the last successful setup, for its timings.
+        const bastion_session* last_session() const { return m_last_session.get(); }
+        uint64_t sessions() const { return m_sessions; }
+        // when keepalive() or a reconnect attempt is due next, max() if
+        // none is.
+        clock::time_point next_timer() const;
+
+        // blocking, runs off the reactor thread.
+        static bastion_session_ptr establish(const tunnel_config& config, setup_canceler& canceler,
+                                             std::string& error);
+        static bastion_session_ptr start_session(const tunnel_config& config, setup_canceler& canceler,
+                                                 bool preferred_methods, int& rc, std::string& error);
+        uint64_t begin_connect();
+        // takes the session of the connect attempt it belongs to, a failed
+        // attempt drops the connections waiting for it.
+        void adopt(uint64_t generation, bastion_session_ptr session, const std::string& error);
+        // the session is gone, so are the connections forwarded through it.
+        // The ones still waiting for a channel are kept for the next session.
+        void disconnect();
+        // ends the connection, its socket is closed and its channel freed
+        // right away and the record goes back to the pool.
+        void release(const connection_ptr& c);
+
+        // keeps an idle session from being dropped by NAT, and its replies
+        // going unacknowledged is how a dead bastion is noticed. False once
+        // the session is lost.
+        bool keepalive(clock::time_point now);
+        // the socket under the session failed.
+        void socket_failed() { m_lost = true; }
+        // backs off the attempts to reconnect while the bastion is away.
+        void schedule_retry(clock::time_point now);
+        bool retry_due(clock::time_point now) const;
+        // writes waited for the scheduler in the last service round.
+        bool throttled() const { return m_throttled; }
+
+        // opens the pending channels and moves the data of all the
+        // connections, false once the session is lost.
+        bool service();
+
+    private:
+        enum op_t { OP_NONE, OP_OPEN, OP_FREE, OP_WRITE, OP_EOF, OP_READ };
+
+        bool open_channels();
+        bool free_channels();
+        bool service_io(const connection_ptr& c);
+        bool channel_write(const connection_ptr& c, size_t size);
+        bool send_eof(const connection_ptr& c);
+        bool channel_read(const connection_ptr& c);
+        bool resume_blocked();
+        void retire(const connection_ptr& c);
+        bool would_block(op_t op, const connection_ptr& c);
+        void fail(connection* c, int rc, const char* what);
+
+    private:
+        const tunnel_config m_config;
+        bandwidth_scheduler& m_scheduler;
+        state_t m_state = DISCONNECTED;
+        uint64_t m_generation = 0;
+        bastion_session_ptr m_session;
+        bool m_lost = false;
+        bastion_session_ptr m_last_session;
+        uint64_t m_sessions = 0;
+        clock::time_point m_next_keepalive;
+        bool m_retry_pending = false;
+        unsigned int m_retries = 0;
+        clock::time_point m_retry_at;
+
+        std::list<connection_ptr> m_connections;
+        connection_pool m_pool;
+        // libssh2 opens one channel of a session at a time.
+        connection_ptr m_opening;
+        // channels waiting for the close handshake to finish.
+        std::list<LIBSSH2_CHANNEL*> m_closing;
+
+        // libssh2 keeps a half-sent packet in the session and completes it
+        // with whatever send comes next, reporting that one as done. The
+        // call that blocked is thus retried before anything else is sent.
+        op_t m_blocked_op = OP_NONE;
+        connection_ptr m_blocked_conn;
+        // the size of a blocked write, its retry must not differ.
+        size_t m_blocked_size = 0;
+        bool m_throttled = false;
+        // directions libssh2 was blocked in during the last service round.
+        int m_block_directions = 0;
+    };
+    typedef std::unique_ptr<bastion_transport> bastion_transport_ptr;
+
+    // a local listening socket, the connections it accepts are forwarded
+    // through the bastion transport of its user.
+    class ssh_tunnel
+    {
+    public:
+        ssh_tunnel(uint64_t id, const tunnel_config& config);
         ~ssh_tunnel();
         ssh_tunnel_ret start();
         void stop();
 
+        uint64_t id() const { return m_id; }
+        const tunnel_config& config() const { return m_config; }
+        int listen_sock() const { return m_listen_sock; }
+        unsigned int local_port() const { return m_local_port; }
+        const tunnel_metrics& metrics() const { return *m_metrics; }
+        tunnel_metrics& metrics() { return *m_metrics; }
+
+        connection_ptr accept_connection(connection_pool& pool);
+
     private:
-        bool run();
         bool setup_listening_socket();
-        bool establish_connection_to_bastion(one_session& os);
-        bool service_io(one_session& os);
-        int connect_to_bastion();
 
     private:
-        std::thread m_thread;
-
-        bool m_should_stop;
-        std::string m_username;
-        std::string m_bastion_public_key;
-        std::string m_bastion_private_key;
-        std::string m_local_host;
-        std::pair<unsigned int, unsigned int> m_local_port_range;
-        std::string m_bastion_host;
-        unsigned int m_bastion_port;
-        std::string m_dest_host;
-        unsigned int m_dest_port;
+        const uint64_t m_id;
+        const tunnel_config m_config;
         unsigned int m_local_port;
         int m_listen_sock;
-        std::list<one_session> m_all_sessions;
+        tunnel_metrics_ptr m_metrics;
     };
 
 public:
     ssh_manager();
+    // tunnels through another bastion, e.g. a local sshd for benchmarking.
+    ssh_manager(const std::string& bastion_host, unsigned int bastion_port);
     ~ssh_manager();
 
     ssh_tunnel_ret start_ssh_tunnel(const std::string& session_name,
                                     const std::string& bastion_username,
                                     const std::string& bastion_key_file,
                                     const std::string& desthost,
-                                    const unsigned int destport);  
-    void stop_ssh_tunnel(const std::string& session_name);  
-    
+                                    const unsigned int destport,
+                                    tunnel_profile profile = INTERACTIVE);
+    void stop_ssh_tunnel(const std::string& session_name);
+
+    // a snapshot of the traffic of every tunnel.
+    std::vector<tunnel_stats> tunnel_statistics();
+
+    void set_bandwidth_caps(const bandwidth_caps& caps);
+    bandwidth_caps current_bandwidth_caps();
+
     ssh_tunnel_ret start_rsync_tunnel(const std::string& username,
                                       const std::string& bastion_key_file)
     {
-        return start_ssh_tunnel("rsync." + username, 
+        return start_ssh_tunnel("rsync." + username,
                                 username,
                                 bastion_key_file,
-                                RSYNC_SERVER_HOSTNAME, 
-                                RSYNC_SERVER_PORT);
+                                RSYNC_SERVER_HOSTNAME,
+                                RSYNC_SERVER_PORT,
+                                BULK);
     }
     void stop_rsync_tunnel(const std::string& username)
     {
         return stop_ssh_tunnel("rsync." + username);
     }
 
+    // forwards in_fd/out_fd straight into a channel to desthost:destport,
+    // without a local listener. Blocks until the client or the server side
+    // closes, made for ssh's ProxyCommand. The descriptors are closed.
+    // Returns why the connection failed, empty if it didn't.
+    std::string run_stdio_proxy(const std::string& bastion_username,
+                                const std::string& bastion_key_file,
+                                const std::string& desthost,
+                                const unsigned int destport,
+                                tunnel_profile profile,
+                                int in_fd, int out_fd);
+    std::string run_rsync_proxy(const std::string& username,
+                                const std::string& bastion_key_file,
+                                int in_fd, int out_fd)
+    {
+        return run_stdio_proxy(username, bastion_key_file, 
+                        RSYNC_SERVER_HOSTNAME, RSYNC_SERVER_PORT, 
+                        BULK, in_fd, out_fd);
+    }
+
+private:
+    // the reactor: a single thread polls the listeners, the local sockets
+    // and the bastion transports of all the tunnels. Everything touching the
+    // tunnels runs on it, other threads post tasks.
+    void reactor_loop();
+    void post(std::function<void()> task);
+    void run_on_reactor(const std::function<void()>& task);
+    void run_posted_tasks();
+    tunnel_config make_config(const std::string& bastion_username,
+                              const std::string& bastion_key_file,
+                              const std::string& desthost,
+                              unsigned int destport,
+                              tunnel_profile profile) const;
+    void accept_connections(ssh_tunnel& tunnel);
+    bastion_transport& transport_for(const tunnel_config& config);
+    void connect_transport(bastion_transport& transport);
+    void service_transport(bastion_transport& transport);
+    void retire_tunnel(ssh_tunnel& tunnel);
+    // updates the moving averages, at most once per interval unless forced.
+    void sample_rates(bool force);
+    bool transport_in_use(const std::string& key) const;
+    // keepalives and reconnect attempts, returns the poll timeout until
+    // the next one.
+    int run_timers();
+
 private:
 
     const std::string  LOCAL_SSH_HOSTNAME   = "127.0.0.1";
     const unsigned int LOCAL_SSH_PORT_START   = 2000;
-    const std::string  BASTION_SSH_HOSTNAME = "metriffic.com";
-    const unsigned int BASTION_SSH_PORT = 2222;
+    // static, the default constructor delegates with them.
+    static constexpr const char* BASTION_SSH_HOSTNAME = "metriffic.com";
+    static constexpr unsigned int BASTION_SSH_PORT = 2222;
+    const std::string  m_bastion_host;
+    const unsigned int m_bastion_port;
 
     const std::string  RSYNC_SERVER_HOSTNAME = "metriffic";
     const unsigned int RSYNC_SERVER_PORT = 7000;
 
+    // reactor thread only.
     std::map<std::string, std::unique_ptr<ssh_tunnel>> m_session_tunnels;
+    std::map<std::string, bastion_transport_ptr> m_transports;
+    bandwidth_scheduler m_scheduler;
+    std::list<std::future<void>> m_setups;
+    setup_canceler m_setup_canceler;
     bool m_should_stop = false;
+
+    uint64_t m_tunnel_seq = 0;
+    clock::time_point m_last_sample;
+    std::thread m_reactor;
+    int m_wakeup_pipe[2] = {-1, -1};
+    std::mutex m_tasks_mutex;
+    std::vector<std::function<void()>> m_tasks;
 };
 
 } // namespace metriffic
@@ -0,0 +1,365 @@
+#include "sync_engine.hpp"
+#include <plog/Log.h>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <tuple>
+#include <regex>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+namespace metriffic
+{
+
+namespace
+{
+    const size_t HASH_CHUNK = 1 << 20;
+
+    // rsync --info=progress2 line, the totals of the whole transfer, e.g.
+    //  "  1,234,567  45%   10.00MB/s    0:00:01 (xfr#3, to-chk=12/345)"
+    const std::regex PROGRESS_LINE(
+        "^\\s*([0-9,]+)\\s+([0-9]+)%\\s+([0-9.]+)([kMGT]?)B/s\\s+\\S+"
+        "(?:\\s+\\(xfr#[0-9]+, (?:to|ir)-chk=([0-9]+)/([0-9]+)\\))?");
+    const std::string PROCESSING_PREFIX = "processing: ";
+
+    uint64_t
+    parse_grouped(const std::string& s)
+    {
+        uint64_t v = 0;
+        for(char c : s) {
+            if(c >= '0' && c <= '9') {
+                v = v * 10 + (c - '0');
+            }
+        }
+        return v;
+    }
+
+    double
+    unit_multiplier(const std::string& unit)
+    {
+        if(unit == "k") return 1024.;
+        if(unit == "M") return 1024. * 1024.;
+        if(unit == "G") return 1024. * 1024. * 1024.;
+        if(unit == "T") return 1024. * 1024. * 1024. * 1024.;
+        return 1.;
+    }
+}
+
+sync_engine::rsync_progress_parser::rsync_progress_parser(uint64_t bytes_total,
+                                                          progress_callback callback)
+ : m_callback(std::move(callback)),
+   m_total_known(bytes_total > 0)
+{
+    m_progress.bytes_total = bytes_total;
+}
+
+void
+sync_engine::rsync_progress_parser::feed(const char* data, size_t size)
+{
+    const char* end = data + size;
+    while(data < end) {
+        auto eol = std::find_if(data, end, [](char c) { return c == '\r' || c == '\n'; });
+        m_line.append(data, eol);
+        if(eol == end) {
+            break;
+        }
+        if(!m_line.empty()) {
+            parse_line(m_line);
+            m_line.clear();
+        }
+        data = eol + 1;
+    }
+}
+
+void
+sync_engine::rsync_progress_parser::finish()
+{
+    if(!m_line.empty()) {
+        parse_line(m_line);
+        m_line.clear();
+    }
+}
+
+void
+sync_engine::rsync_progress_parser::parse_line(const std::string& line)
+{
+    if(line.compare(0, PROCESSING_PREFIX.size(), PROCESSING_PREFIX) == 0) {
+        m_progress.current = line.substr(PROCESSING_PREFIX.size());
+    } else {
+        std::smatch m;
+        if(!std::regex_search(line, m, PROGRESS_LINE)) {
+            // file list chatter, summary lines etc.
+            PLOGV << "rsync: " << line;
+            return;
+        }
+        m_progress.bytes_done = parse_grouped(m[1].str());
+        m_progress.percent = std::stoi(m[2].str());
+        m_progress.rate = std::stod(m[3].str()) * unit_multiplier(m[4].str());
+        if(!m_total_known && m_progress.percent > 0) {
+            m_progress.bytes_total = m_progress.bytes_done * 100 / m_progress.percent;
+        }
+        if(m[5].matched) {
+            // rsync tells how many entries are left after each file.
+            size_t to_check = std::stoul(m[5].str());
+            m_progress.files_total = std::stoul(m[6].str());
+            m_progress.files_done = m_progress.files_total - std::min(to_check, m_progress.files_total);
+        }
+    }
+    if(m_callback) {
+        m_callback(m_progress);
+    }
+}
+
+sync_engine::sync_engine(size_t threads)
+ : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+{}
+
+sync_engine::scan_result
+sync_engine::scan(const std::filesystem::path& root, const std::string& folder, bool hash) const
+{
+    scan_result result;
+    auto start = root;
+    if(!folder.empty()) {
+        start /= folder;
+    }
+    walk(start, result);
+    if(!folder.empty()) {
+        // keep the paths relative to the workspace, not to the folder.
+        for(auto& f : result.files) {
+            f.path = folder + "/" + f.path;
+        }
+    }
+    std::sort(result.files.begin(), result.files.end(),
+              [](const file_entry& a, const file_entry& b) { return a.path < b.path; });
+    if(hash) {
+        std::vector<size_t> all(result.files.size());
+        for(size_t i = 0; i < all.size(); ++i) {
+            all[i] = i;
+        }
+        auto errors = this->hash(root, result.files, std::move(all));
+        result.errors.insert(result.errors.end(), errors.begin(), errors.end());
+    }
+    PLOGV << "scanned " << root << ": " << result.files.size() << " files, "
+          << result.total_bytes << " bytes, " << result.errors.size() << " errors";
+    return result;
+}
+
+void
+sync_engine::walk(const std::filesystem::path& root, scan_result& result) const
+{
+    namespace fs = std::filesystem;
+
+    // directories are the unit of work, each worker lists one and queues
+    // the subdirectories it finds for whoever is idle.
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<fs::path> pending;
+    size_t busy = 0;
+    pending.push_back(fs::path());
+
+    auto worker = [&]() {
+        std::vector<file_entry> files;
+        std::vector<std::string> errors;
+        std::vector<fs::path> subdirs;
+        size_t directories = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while(true) {
+            cv.wait(guard, [&]() { return !pending.empty() || busy == 0; });
+            if(pending.empty()) {
+                break;
+            }
+            fs::path rel = std::move(pending.front());
+            pending.pop_front();
+            ++busy;
+            guard.unlock();
+
+            ++directories;
+            std::error_code ec;
+            fs::directory_iterator it(root / rel, ec), end;
+            for(; !ec && it != end; it.increment(ec)) {
+                const auto& entry = *it;
+                std::error_code sec;
+                auto status = entry.symlink_status(sec);
+                if(sec) {
+                    errors.push_back(entry.path().string() + ": " + sec.message());
+                    continue;
+                }
+                auto name = rel / entry.path().filename();
+                if(fs::is_directory(status)) {
+                    subdirs.push_back(std::move(name));
+                } else
+                if(fs::is_regular_file(status) || fs::is_symlink(status)) {
+                    // one lstat for everything, the entry caches only the type.
+                    struct stat st;
+                    if(::lstat(entry.path().c_str(), &st) != 0) {
+                        errors.push_back(entry.path().string() + ": " + std::strerror(errno));
+                        continue;
+                    }
+                    file_entry f;
+                    f.path = name.generic_string();
+                    f.size = st.st_size;
+                    f.mtime = mtime_ns(st);
+                    f.inode = st.st_ino;
+                    f.symlink = S_ISLNK(st.st_mode);
+                    files.push_back(std::move(f));
+                }
+            }
+            if(ec) {
+                errors.push_back((root / rel).string() + ": " + ec.message());
+            }
+
+            guard.lock();
+            --busy;
+            for(auto& d : subdirs) {
+                pending.push_back(std::move(d));
+            }
+            subdirs.clear();
+            cv.notify_all();
+        }
+        for(auto& f : files) {
+            result.total_bytes += f.size;
+            result.files.push_back(std::move(f));
+        }
+        result.errors.insert(result.errors.end(), errors.begin(), errors.end());
+        result.directories += directories;
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < m_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(auto& t : threads) {
+        t.join();
+    }
+}
+
+std::vector<std::string>
+sync_engine::hash(const std::filesystem::path& root,
+                  std::vector<file_entry>& files,
+                  std::vector<size_t> which) const
+{
+    // biggest files first so that one large file doesn't end up last on a
+    // single thread while the rest are idle.
+    std::sort(which.begin(), which.end(), [&](size_t a, size_t b) {
+        return files[a].size > files[b].size;
+    });
+
+    std::vector<std::string> errors;
+    std::atomic<size_t> next(0);
+    std::mutex lock;
+    auto worker = [&]() {
+        std::string error;
+        for(size_t i = next++; i < which.size(); i = next++) {
+            auto& f = files[which[i]];
+            f.digest = hash_file(root / f.path, f.symlink, error);
+            if(f.digest.empty()) {
+                std::lock_guard<std::mutex> guard(lock);
+                errors.push_back((root / f.path).string() + ": " + error);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < std::min(m_threads, which.size()); ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(auto& t : threads) {
+        t.join();
+    }
+    return errors;
+}
+
+int64_t
+sync_engine::mtime_ns(const struct stat& st)
+{
+#ifdef __APPLE__
+    const auto& t = st.st_mtimespec;
+#else
+    const auto& t = st.st_mtim;
+#endif
+    return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+std::vector<size_t>
+sync_engine::balance(const std::vector<uint64_t>& sizes, size_t n)
+{
+    // largest first, each to the lightest bucket. Ties go to the bucket
+    // with fewer items, so that lots of empty files still spread out.
+    std::vector<size_t> order(sizes.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    typedef std::tuple<uint64_t, size_t, size_t> load; // bytes, items, bucket
+    std::priority_queue<load, std::vector<load>, std::greater<load>> buckets;
+    for(size_t b = 0; b < std::max<size_t>(n, 1); ++b) {
+        buckets.emplace(0, 0, b);
+    }
+    std::vector<size_t> result(sizes.size());
+    for(auto i : order) {
+        auto [bytes, items, b] = buckets.top();
+        buckets.pop();
+        result[i] = b;
+        buckets.emplace(bytes + sizes[i], items + 1, b);
+    }
+    return result;
+}
+
+std::string
+sync_engine::hash_file(const std::filesystem::path& path, bool symlink, std::string& error)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if(!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1) {
+        error = "cannot initialize the digest";
+        return "";
+    }
+    std::ifstream in;
+    if(symlink) {
+        std::error_code ec;
+        auto target = std::filesystem::read_symlink(path, ec).string();
+        if(ec) {
+            error = ec.message();
+            return "";
+        }
+        EVP_DigestUpdate(ctx.get(), target.data(), target.size());
+    } else {
+        in.open(path, std::ios::binary);
+        if(!in) {
+            error = "cannot open";
+            return "";
+        }
+    }
+    std::vector<char> buffer(HASH_CHUNK);
+    while(in.is_open() && in) {
+        in.read(buffer.data(), buffer.size());
+        if(in.gcount() > 0) {
+            EVP_DigestUpdate(ctx.get(), buffer.data(), in.gcount());
+        }
+    }
+    if(in.bad()) {
+        error = "read failed";
+        return "";
+    }
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_size = 0;
+    EVP_DigestFinal_ex(ctx.get(), md, &md_size);
+    static const char* HEX = "0123456789abcdef";
+    std::string digest(md_size * 2, '0');
+    for(unsigned int i = 0; i < md_size; ++i) {
+        digest[2 * i] = HEX[md[i] >> 4];
+        digest[2 * i + 1] = HEX[md[i] & 0xf];
+    }
+    return digest;
+}
+
+} // namespace metriffic
@@ -0,0 +1,109 @@
+#ifndef SYNC_ENGINE_HPP
+#define SYNC_ENGINE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+#include <sys/stat.h>
+
+namespace metriffic
+{
+
+// the local side of a workspace sync. The tree is scanned (and hashed, if
+// asked) on all the cores, and the output of the rsync doing the transfer
+// is turned into structured progress. The remote end of a workspace is a
+// plain rsync over ssh, so the delta transfer itself stays with rsync.
+class sync_engine
+{
+public:
+    struct file_entry
+    {
+        // relative to the scanned root, with '/' separators.
+        std::string path;
+        uint64_t size = 0;
+        // nanoseconds since the epoch.
+        int64_t mtime = 0;
+        uint64_t inode = 0;
+        // not followed, the digest covers the target path.
+        bool symlink = false;
+        // hex SHA-256 of the content, empty unless hashed.
+        std::string digest;
+    };
+
+    struct scan_result
+    {
+        // sorted by path.
+        std::vector<file_entry> files;
+        uint64_t total_bytes = 0;
+        size_t directories = 0;
+        // what couldn't be read, the scan goes on without it.
+        std::vector<std::string> errors;
+    };
+
+    struct progress
+    {
+        // the file being transferred.
+        std::string current;
+        // bytes per second, as rsync reports it.
+        double rate = 0;
+        size_t files_done = 0;
+        // 0 until rsync tells, it grows while rsync builds its file list.
+        size_t files_total = 0;
+        uint64_t bytes_done = 0;
+        // estimated from rsync's percentage if not known upfront, e.g. for
+        // a download.
+        uint64_t bytes_total = 0;
+        int percent = 0;
+    };
+    typedef std::function<void(const progress&)> progress_callback;
+
+    // turns the output of 'rsync --info=progress2 --out-format="processing: %f"'
+    // into progress updates. The output may come in chunks of any size.
+    class rsync_progress_parser
+    {
+    public:
+        rsync_progress_parser(uint64_t bytes_total, progress_callback callback);
+        void feed(const char* data, size_t size);
+        // flushes a last unterminated line.
+        void finish();
+        const progress& state() const { return m_progress; }
+
+    private:
+        void parse_line(const std::string& line);
+
+    private:
+        progress m_progress;
+        progress_callback m_callback;
+        std::string m_line;
+        const bool m_total_known;
+    };
+
+    // 0 threads use all the cores.
+    explicit sync_engine(size_t threads = 0);
+
+    // lists the regular files and symlinks under root/folder, folder may be
+    // empty. Symlinks are not followed.
+    scan_result scan(const std::filesystem::path& root, const std::string& folder, bool hash) const;
+    // the modification time of a stat in nanoseconds, see file_entry.
+    static int64_t mtime_ns(const struct stat& st);
+    // spreads items of the given sizes over n buckets of about the same
+    // total size, returns the bucket of each item.
+    static std::vector<size_t> balance(const std::vector<uint64_t>& sizes, size_t n);
+    // hashes the given files of a scan of root, returns what couldn't be read.
+    std::vector<std::string> hash(const std::filesystem::path& root,
+                                  std::vector<file_entry>& files,
+                                  std::vector<size_t> which) const;
+
+private:
+    void walk(const std::filesystem::path& root, scan_result& result) const;
+    static std::string hash_file(const std::filesystem::path& path, bool symlink, std::string& error);
+
+private:
+    const size_t m_threads;
+};
+
+} // namespace metriffic
+
+#endif //SYNC_ENGINE_HPP
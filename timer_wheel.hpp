@@ -0,0 +1,84 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+namespace metriffic
+{
+
+// hashed timer wheel: O(1) schedule/cancel, each tick only visits the
+// timers of the current slot. Not thread-safe, meant to be driven by a
+// single (asio) thread.
+class timer_wheel
+{
+public:
+    explicit timer_wheel(size_t slots)
+     : m_slots(slots)
+    {}
+
+    void schedule(int id, size_t ticks)
+    {
+        cancel(id);
+        if(ticks == 0) {
+            ticks = 1;
+        }
+        size_t slot = (m_cursor + ticks) % m_slots.size();
+        size_t rounds = (ticks - 1) / m_slots.size();
+        auto& entries = m_slots[slot];
+        entries.push_back({id, rounds});
+        m_index[id] = std::make_pair(slot, std::prev(entries.end()));
+    }
+
+    bool cancel(int id)
+    {
+        auto fit = m_index.find(id);
+        if(fit == m_index.end()) {
+            return false;
+        }
+        m_slots[fit->second.first].erase(fit->second.second);
+        m_index.erase(fit);
+        return true;
+    }
+
+    // moves the wheel by one tick, returns the ids of the expired timers.
+    std::vector<int> advance()
+    {
+        std::vector<int> expired;
+        m_cursor = (m_cursor + 1) % m_slots.size();
+        auto& entries = m_slots[m_cursor];
+        for(auto it = entries.begin(); it != entries.end(); ) {
+            if(it->rounds > 0) {
+                --it->rounds;
+                ++it;
+                continue;
+            }
+            expired.push_back(it->id);
+            m_index.erase(it->id);
+            it = entries.erase(it);
+        }
+        return expired;
+    }
+
+    bool empty() const
+    {
+        return m_index.empty();
+    }
+
+private:
+    struct entry
+    {
+        int id;
+        size_t rounds;
+    };
+    std::vector<std::list<entry>> m_slots;
+    std::unordered_map<int, std::pair<size_t, std::list<entry>::iterator>> m_index;
+    size_t m_cursor = 0;
+};
+
+} // namespace metriffic
+
+#endif //TIMER_WHEEL_HPP
@@ -0,0 +1,371 @@
+// throughput and latency benchmark of the ssh tunnels.
+//
+// ssh_manager is pointed at a local OpenSSH server standing in for the
+// bastion, the tunnel forwards to an echo server on its side. For example:
+//
+//   ssh-keygen -t rsa -m PEM -N '' -f /tmp/bench/key
+//   ssh-keygen -t ed25519 -N '' -f /tmp/bench/host_key
+//   $(command -v sshd) -D -f /dev/null -p 2222 -h /tmp/bench/host_key
+//       -o AuthorizedKeysFile=/tmp/bench/key.pub -o PidFile=none
+//   ./tunnel_bench -u $USER -k /tmp/bench/key -n 8
+//
+// Unless --dest-port is given, the echo server is a child process on
+// 127.0.0.1, so its CPU time isn't accounted to the tunnel. The reported
+// CPU covers this process: the reactor and the (cheap) load generators.
+
+#include <cxxopts.hpp>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "ssh_manager.hpp"
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock;
+
+double
+cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+bool
+write_all(int fd, const char* data, size_t size)
+{
+    while(size > 0) {
+        ssize_t n = send(fd, data, size, 0);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool
+read_all(int fd, char* data, size_t size)
+{
+    while(size > 0) {
+        ssize_t n = recv(fd, data, size, 0);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+int
+connect_local(unsigned int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        if(fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// forks an echo server listening on an ephemeral port of 127.0.0.1.
+pid_t
+start_echo_server(unsigned int& port)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t len = sizeof(addr);
+    if(listener == -1 ||
+       bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+       listen(listener, SOMAXCONN) == -1 ||
+       getsockname(listener, (struct sockaddr*)&addr, &len) == -1) {
+        std::cerr << "error: failed to start the echo server: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+
+    pid_t pid = fork();
+    if(pid != 0) {
+        close(listener);
+        return pid;
+    }
+    while(true) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd == -1) {
+            continue;
+        }
+        std::thread([fd]() {
+            std::vector<char> buf(256 * 1024);
+            while(true) {
+                ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+                if(n <= 0 || !write_all(fd, buf.data(), n)) {
+                    break;
+                }
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+struct bulk_result
+{
+    bool ok = true;
+    double mb_per_s = 0;
+    double cpu_per_gb = 0;
+};
+
+// every connection streams its bytes and reads the echo back concurrently.
+bulk_result
+run_bulk(unsigned int port, size_t connections, size_t bytes)
+{
+    bulk_result result;
+    std::atomic<bool> ok{true};
+    const double cpu_start = cpu_seconds();
+    const auto start = bench_clock::now();
+
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < connections; ++i) {
+        workers.emplace_back([&, i]() {
+            int fd = connect_local(port);
+            if(fd == -1) {
+                ok = false;
+                return;
+            }
+            std::thread sender([&, fd, i]() {
+                std::vector<char> chunk(64 * 1024, char('a' + i % 26));
+                for(size_t sent = 0; sent < bytes; sent += chunk.size()) {
+                    if(!write_all(fd, chunk.data(), std::min(chunk.size(), bytes - sent))) {
+                        ok = false;
+                        break;
+                    }
+                }
+                shutdown(fd, SHUT_WR);
+            });
+            std::vector<char> chunk(256 * 1024);
+            size_t received = 0;
+            while(true) {
+                ssize_t n = recv(fd, chunk.data(), chunk.size(), 0);
+                if(n <= 0) {
+                    break;
+                }
+                received += n;
+            }
+            sender.join();
+            close(fd);
+            if(received != bytes) {
+                ok = false;
+            }
+        });
+    }
+    for(auto& w : workers) {
+        w.join();
+    }
+
+    const double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+    const double moved = 2.0 * connections * bytes;
+    result.ok = ok;
+    result.mb_per_s = connections * bytes / elapsed / 1e6;
+    result.cpu_per_gb = (cpu_seconds() - cpu_start) / (moved / 1e9);
+    return result;
+}
+
+struct latency_result
+{
+    bool ok = true;
+    double setup_ms = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+};
+
+// request/response round trips of small messages, one in flight per
+// connection. The first one also opens the channel, it's the setup time.
+latency_result
+run_latency(unsigned int port, size_t connections, size_t messages, size_t size)
+{
+    latency_result result;
+    std::atomic<bool> ok{true};
+    std::vector<std::vector<double>> rtts(connections);
+    std::vector<double> setups(connections, 0);
+
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < connections; ++i) {
+        workers.emplace_back([&, i]() {
+            std::vector<char> request(size, 'r');
+            std::vector<char> response(size);
+            auto start = bench_clock::now();
+            int fd = connect_local(port);
+            if(fd == -1) {
+                ok = false;
+                return;
+            }
+            for(size_t m = 0; m <= messages; ++m) {
+                auto sent = bench_clock::now();
+                if(!write_all(fd, request.data(), size) || !read_all(fd, response.data(), size)) {
+                    ok = false;
+                    break;
+                }
+                auto now = bench_clock::now();
+                if(m == 0) {
+                    setups[i] = std::chrono::duration<double, std::milli>(now - start).count();
+                } else {
+                    rtts[i].push_back(std::chrono::duration<double, std::micro>(now - sent).count());
+                }
+            }
+            close(fd);
+        });
+    }
+    for(auto& w : workers) {
+        w.join();
+    }
+
+    std::vector<double> all;
+    for(const auto& r : rtts) {
+        all.insert(all.end(), r.begin(), r.end());
+    }
+    result.ok = ok && !all.empty();
+    if(!all.empty()) {
+        std::sort(all.begin(), all.end());
+        result.p50_us = all[all.size() / 2];
+        result.p99_us = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+    }
+    std::sort(setups.begin(), setups.end());
+    result.setup_ms = setups[setups.size() / 2];
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    cxxopts::Options options("tunnel_bench", " - ssh tunnel throughput and latency benchmark");
+    options.add_options()
+        ("b,bastion-host", "host of the sshd standing in for the bastion", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+        ("p,bastion-port", "port of the sshd", cxxopts::value<unsigned int>()->default_value("2222"))
+        ("u,user", "user to authenticate as on the sshd", cxxopts::value<std::string>())
+        ("k,key", "private key file, the public one is <key>.pub", cxxopts::value<std::string>())
+        ("dest-host", "echo server as seen from the sshd", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+        ("dest-port", "port of an external echo server, a local one is started otherwise", cxxopts::value<unsigned int>()->default_value("0"))
+        ("n,connections", "up to this many concurrent connections, doubling from 1", cxxopts::value<size_t>()->default_value("8"))
+        ("m,megabytes", "bulk megabytes sent per connection", cxxopts::value<size_t>()->default_value("64"))
+        ("r,requests", "round trips per connection", cxxopts::value<size_t>()->default_value("1000"))
+        ("s,size", "request/response size in bytes", cxxopts::value<size_t>()->default_value("64"))
+        ("bulk", "use the bulk tunnel profile", cxxopts::value<bool>()->default_value("false"))
+        ("h,help", "Print usage");
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << "error parsing options: " << e.what() << std::endl;
+        return 1;
+    }
+    if(result.count("help") || !result.count("user") || !result.count("key")) {
+        std::cout << options.help() << std::endl;
+        return result.count("help") ? 0 : 1;
+    }
+
+    unsigned int dest_port = result["dest-port"].as<unsigned int>();
+    pid_t echo_pid = -1;
+    if(dest_port == 0) {
+        // forked before ssh_manager starts its threads.
+        echo_pid = start_echo_server(dest_port);
+        if(echo_pid == -1) {
+            return 1;
+        }
+    }
+
+    const size_t max_connections = std::max<size_t>(1, result["connections"].as<size_t>());
+    const size_t bytes = result["megabytes"].as<size_t>() << 20;
+    const size_t requests = result["requests"].as<size_t>();
+    const size_t size = std::max<size_t>(1, result["size"].as<size_t>());
+    const auto profile = result["bulk"].as<bool>() ? metriffic::ssh_manager::BULK
+                                                   : metriffic::ssh_manager::INTERACTIVE;
+    int status = 0;
+    {
+        metriffic::ssh_manager ssh(result["bastion-host"].as<std::string>(),
+                                   result["bastion-port"].as<unsigned int>());
+        auto tunnel = ssh.start_ssh_tunnel("bench",
+                                           result["user"].as<std::string>(),
+                                           result["key"].as<std::string>(),
+                                           result["dest-host"].as<std::string>(), dest_port,
+                                           profile);
+        if(!tunnel.status) {
+            std::cerr << "error: failed to start the tunnel." << std::endl;
+            status = 1;
+        } else {
+            std::cout << std::setw(6) << "conns"
+                      << std::setw(12) << "MB/s"
+                      << std::setw(12) << "CPU s/GB"
+                      << std::setw(12) << "setup ms"
+                      << std::setw(12) << "p50 us"
+                      << std::setw(12) << "p99 us" << std::endl;
+            std::vector<size_t> steps;
+            for(size_t n = 1; n < max_connections; n *= 2) {
+                steps.push_back(n);
+            }
+            steps.push_back(max_connections);
+            for(size_t n : steps) {
+                auto bulk = run_bulk(tunnel.local_port, n, bytes);
+                auto latency = run_latency(tunnel.local_port, n, requests, size);
+                std::cout << std::fixed << std::setprecision(1)
+                          << std::setw(6) << n
+                          << std::setw(12) << bulk.mb_per_s
+                          << std::setw(12) << std::setprecision(2) << bulk.cpu_per_gb
+                          << std::setw(12) << latency.setup_ms
+                          << std::setw(12) << std::setprecision(0) << latency.p50_us
+                          << std::setw(12) << latency.p99_us;
+                if(!bulk.ok || !latency.ok) {
+                    std::cout << "  (errors)";
+                    status = 1;
+                }
+                std::cout << std::endl;
+            }
+            ssh.stop_ssh_tunnel("bench");
+        }
+    }
+
+    if(echo_pid != -1) {
+        kill(echo_pid, SIGTERM);
+        waitpid(echo_pid, NULL, 0);
+    }
+    return status;
+}
@@ -0,0 +1,181 @@
+#include "tunnel_commands.hpp"
+#include "utils.hpp"
+
+#include <cxxopts.hpp>
+#include <termcolor/termcolor.hpp>
+#include <nlohmann/json.hpp>
+#include <cstdio>
+
+namespace metriffic
+{
+
+namespace tc = termcolor;
+
+namespace
+{
+    std::string
+    format_rate(uint64_t rate)
+    {
+        return rate ? format_bytes(rate) + "/s" : "none";
+    }
+
+    std::string
+    format_ms(double ms)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.1f ms", ms);
+        return buf;
+    }
+}
+
+tunnel_commands::tunnel_commands(app_context& c)
+ : m_context(c)
+{}
+
+void
+tunnel_commands::tunnels_show(std::ostream& out, const std::vector<ssh_manager::tunnel_stats>& stats, 
+                              const ssh_manager::bandwidth_caps& caps, bool connections)
+{
+    out << "uplink caps: interactive " << tc::bold << format_rate(caps.interactive) << tc::reset
+        << ", bulk " << tc::bold << format_rate(caps.bulk) << tc::reset
+        << ", bulk next to interactive " << tc::bold << format_rate(caps.bulk_yield) << tc::reset << std::endl;
+    if(stats.empty()) {
+        out << "no active tunnels." << std::endl;
+        return;
+    }
+    for(const auto& t : stats) {
+        out << "tunnel: " << tc::bold << tc::underline << tc::cyan << t.name << tc::reset << std::endl;
+        out << "    local port:   " << tc::bold << t.local_port << tc::reset 
+            << " -> " << t.dest_host << ":" << t.dest_port << std::endl;
+        out << "    bastion:      " << tc::bold << t.transport << tc::reset 
+            << " (" << t.transport_state << ", " << t.sessions << " session(s))" << std::endl;
+        out << "    session setup: connect " << tc::bold << format_ms(t.tcp_connect_ms) << tc::reset
+            << ", handshake " << tc::bold << format_ms(t.handshake_ms) << tc::reset
+            << ", auth " << tc::bold << format_ms(t.auth_ms) << tc::reset << std::endl;
+        out << "    channel open: " << tc::bold << format_ms(t.channel_open_ms) << tc::reset << " on average" << std::endl;
+        out << "    sent:         " << tc::bold << format_bytes(t.bytes_out) << tc::reset
+            << " (" << format_bytes(t.rate_out) << "/s)" << std::endl;
+        out << "    received:     " << tc::bold << format_bytes(t.bytes_in) << tc::reset
+            << " (" << format_bytes(t.rate_in) << "/s)" << std::endl;
+        out << "    stalls:       " << tc::bold << t.channel_stalls << tc::reset << " on the bastion side, "
+            << tc::bold << t.client_stalls << tc::reset << " on the local side" << std::endl;
+        out << "    connections:  " << tc::bold << t.connections_active << tc::reset << " active, "
+            << t.connections_total << " total, " << t.connections_failed << " failed" << std::endl;
+        if(!connections) {
+            continue;
+        }
+        for(const auto& c : t.connections) {
+            out << "        " << c.source << ": sent " << format_bytes(c.bytes_out)
+                << ", received " << format_bytes(c.bytes_in)
+                << ", up " << int(c.age_s) << " s";
+            if(c.channel_open_ms > 0) {
+                out << ", channel opened in " << format_ms(c.channel_open_ms);
+            } else {
+                out << ", waiting for a channel";
+            }
+            out << std::endl;
+        }
+    }
+}
+
+void
+tunnel_commands::tunnels_dump(std::ostream& out, const std::vector<ssh_manager::tunnel_stats>& stats,
+                              const ssh_manager::bandwidth_caps& caps)
+{
+    nlohmann::json tunnels = nlohmann::json::array();
+    for(const auto& t : stats) {
+        nlohmann::json connections = nlohmann::json::array();
+        for(const auto& c : t.connections) {
+            connections.push_back({
+                {"source", c.source},
+                {"bytes_out", c.bytes_out},
+                {"bytes_in", c.bytes_in},
+                {"channel_open_ms", c.channel_open_ms},
+                {"age_s", c.age_s}
+            });
+        }
+        tunnels.push_back({
+            {"name", t.name},
+            {"transport", t.transport},
+            {"transport_state", t.transport_state},
+            {"local_port", t.local_port},
+            {"dest_host", t.dest_host},
+            {"dest_port", t.dest_port},
+            {"bytes_out", t.bytes_out},
+            {"bytes_in", t.bytes_in},
+            {"rate_out", t.rate_out},
+            {"rate_in", t.rate_in},
+            {"channel_stalls", t.channel_stalls},
+            {"client_stalls", t.client_stalls},
+            {"connections_active", t.connections_active},
+            {"connections_total", t.connections_total},
+            {"connections_failed", t.connections_failed},
+            {"sessions", t.sessions},
+            {"tcp_connect_ms", t.tcp_connect_ms},
+            {"handshake_ms", t.handshake_ms},
+            {"auth_ms", t.auth_ms},
+            {"channel_open_ms", t.channel_open_ms},
+            {"connections", connections}
+        });
+    }
+    nlohmann::json dump = {
+        {"caps", {
+            {"interactive", caps.interactive},
+            {"bulk", caps.bulk},
+            {"bulk_yield", caps.bulk_yield}
+        }},
+        {"tunnels", tunnels}
+    };
+    out << dump.dump(4) << std::endl;
+}
+
+std::shared_ptr<cli::Command> 
+tunnel_commands::create_tunnels_cmd()
+{
+    return create_cmd_helper(
+        CMD_TUNNELS_NAME,
+        [this](std::ostream& out, int argc, char** argv){ 
+
+            cxxopts::Options options(CMD_TUNNELS_NAME, CMD_TUNNELS_HELP);
+            options.add_options()
+                ("c,connections", CMD_TUNNELS_PARAMDESC[0], cxxopts::value<bool>()->default_value("false"))
+                ("j,json", CMD_TUNNELS_PARAMDESC[1], cxxopts::value<bool>()->default_value("false"))
+                ("cap-interactive", CMD_TUNNELS_PARAMDESC[2], cxxopts::value<uint64_t>())
+                ("cap-bulk", CMD_TUNNELS_PARAMDESC[3], cxxopts::value<uint64_t>())
+                ("cap-bulk-yield", CMD_TUNNELS_PARAMDESC[4], cxxopts::value<uint64_t>());
+
+            try {
+                auto result = options.parse(argc, argv);
+                auto caps = m_context.ssh.current_bandwidth_caps();
+                if(result.count("cap-interactive") || result.count("cap-bulk") || 
+                   result.count("cap-bulk-yield")) {
+                    const std::pair<const char*, uint64_t*> settings[] = {
+                        {"cap-interactive", &caps.interactive},
+                        {"cap-bulk", &caps.bulk},
+                        {"cap-bulk-yield", &caps.bulk_yield}
+                    };
+                    for(const auto& setting : settings) {
+                        if(result.count(setting.first)) {
+                            *setting.second = result[setting.first].as<uint64_t>() * 1024;
+                        }
+                    }
+                    m_context.ssh.set_bandwidth_caps(caps);
+                }
+                auto stats = m_context.ssh.tunnel_statistics();
+                if(result["json"].as<bool>()) {
+                    tunnels_dump(out, stats, caps);
+                } else {
+                    tunnels_show(out, stats, caps, result["connections"].as<bool>());
+                }
+            } catch (std::exception& e) {
+                out << CMD_TUNNELS_NAME << ": " << e.what() << std::endl;
+                return;
+            }        
+        },
+        [](std::ostream&){},
+        CMD_TUNNELS_HELP,
+        CMD_TUNNELS_PARAMDESC
+    );
+}
+
+} // namespace metriffic
@@ -0,0 +1,41 @@
+#ifndef TUNNEL_COMMANDS_HPP
+#define TUNNEL_COMMANDS_HPP
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cli/cli.h>
+
+#include "app_context.hpp"
+
+namespace metriffic
+{
+
+class tunnel_commands
+{    
+public:
+    tunnel_commands(app_context& c);
+    std::shared_ptr<cli::Command> create_tunnels_cmd();
+
+private:
+    void tunnels_show(std::ostream& out, const std::vector<ssh_manager::tunnel_stats>& stats,
+                      const ssh_manager::bandwidth_caps& caps, bool connections);
+    void tunnels_dump(std::ostream& out, const std::vector<ssh_manager::tunnel_stats>& stats,
+                      const ssh_manager::bandwidth_caps& caps);
+
+private: 
+    app_context& m_context;
+    const std::string CMD_TUNNELS_NAME = "tunnels";
+    const std::string CMD_TUNNELS_HELP = "show the traffic and the setup times of the ssh tunnels...";
+    const std::vector<std::string> CMD_TUNNELS_PARAMDESC = {
+        {"-c|--connections: list the open connections of each tunnel as well."},
+        {"-j|--json: print the figures as json, for scripts."},
+        {"--cap-interactive <KB/s>: caps the uplink of the interactive tunnels, 0 lifts the cap."},
+        {"--cap-bulk <KB/s>: caps the uplink of the bulk (sync) tunnels, 0 lifts the cap."},
+        {"--cap-bulk-yield <KB/s>: caps the bulk tunnels while interactive traffic flows (1024 by default), 0 lifts the cap."},
+    };
+};
+
+} // namespace metriffic
+
+#endif //TUNNEL_COMMANDS_HPP
@@ -1,5 +1,7 @@
 #include "utils.hpp"
 #include <regex>
+#include <cstdio>
+#include <algorithm>
 #include <iostream>
 #include <termios.h>
 #include <unistd.h>
@@ -12,4 +14,38 @@ bool validate_email(const std::string& email)
         //("^([0-9a-zA-Z]([-.\\w]*[0-9a-zA-Z])*@([0-9a-zA-Z][-\\w]*[0-9a-zA-Z]\\.)+[a-zA-Z]{2,9})$");
     // try to match the string with the regular expression
     return std::regex_match(email, pattern);
-}
\ No newline at end of file
+}
+
+std::string
+format_bytes(double bytes)
+{
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    size_t unit = 0;
+    while(bytes >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+        bytes /= 1024.0;
+        ++unit;
+    }
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.1f %s", bytes, units[unit]);
+    return buf;
+}
+
+void
+print_progress_bar(std::ostream& out, const std::string& what, float progress,
+                   const std::string& details)
+{
+    constexpr int BARWIDTH = 30;
+
+    progress = std::min(std::max(progress, 0.0f), 1.0f);
+    out << "\r\t" << what << " [";
+    int pos = BARWIDTH * progress;
+    for (int i = 0; i < BARWIDTH; ++i) {
+        if (i < pos) out << "=";
+        else if (i == pos) out << ">";
+        else out << " ";
+    }
+    out << "] " << int(progress * 100.0) << " %" << details;
+    // clear the leftovers of a longer previous line.
+    out << "    ";
+    out.flush();
+}
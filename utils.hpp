@@ -2,11 +2,19 @@
 #define UTILS_HPP
 
 #include <string>
+#include <ostream>
 #include <cli/cli.h>
 
 
 bool validate_email(const std::string& email);
 
+// e.g. "1.5 MB".
+std::string format_bytes(double bytes);
+// rewrites the current line with "<what> [====>   ] 42 %" and the details,
+// progress is a fraction.
+void print_progress_bar(std::ostream& out, const std::string& what, float progress,
+                        const std::string& details);
+
 template<typename F, typename CancelF>
 std::shared_ptr<cli::Command> 
 create_cmd_helper(const std::string& name,
@@ -1,5 +1,8 @@
 #include "workspace_commands.hpp"
 #include "utils.hpp"
+#include "workspace_manifest.hpp"
+#include "workspace_watcher.hpp"
+#include "child_process.hpp"
 #include <cxxopts.hpp>
 #include <plog/Log.h>
 #include <regex>
@@ -12,6 +15,13 @@
 #include <stdexcept>
 #include <string>
 #include <array>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 namespace metriffic
 {
@@ -20,32 +30,107 @@ workspace_commands::workspace_commands(app_context& c)
  : m_context(c)
 {}
 
+// ssh expands '%' tokens in a ControlPath.
+static std::string
+ssh_token_escape(const std::string& s)
+{
+    std::string out;
+    for(char c : s) {
+        out += c == '%' ? "%%" : std::string(1, c);
+    }
+    return out;
+}
+
+// the ControlPath of the ssh in rsync's -e: rsync splits that command at
+// spaces unless quoted, and the shell sees it in single quotes.
+static std::string
+quote_control_path(const std::string& path)
+{
+    auto escaped = ssh_token_escape(path);
+    char q = escaped.find('"') == std::string::npos ? '"' : '\'';
+    std::string out;
+    for(char c : q + escaped + q) {
+        out += c == '\'' ? "'\\''" : std::string(1, c);
+    }
+    return out;
+}
+
+void
+workspace_commands::print_sync_progress(std::ostream& out, const sync_engine::progress& p)
+{
+    // bytes when the total is known, files otherwise.
+    float progress = 0.0f;
+    if(p.bytes_total > 0) {
+        progress = float(p.bytes_done) / float(p.bytes_total);
+    } else
+    if(p.files_total > 0) {
+        progress = float(p.files_done) / float(p.files_total);
+    }
+
+    std::stringstream details;
+    if(p.files_total > 0) {
+        details << "  " << p.files_done << "/" << p.files_total << " files";
+    }
+    details << "  " << format_bytes(p.bytes_done);
+    if(p.bytes_total > 0) {
+        details << "/" << format_bytes(p.bytes_total);
+    }
+    details << "  " << format_bytes(p.rate) << "/s";
+    print_progress_bar(out, "sync", progress, details.str());
+}
+
 std::string 
 workspace_commands::build_rsynch_commandline(std::ostream& out,
                                              const std::string& username, 
                                              const std::string& dest_host,
                                              unsigned int local_port,
+                                             bool use_proxy,
                                              bool enable_delete,
                                              const std::string& direction,
                                              const std::string& user_workspace,
-                                             const std::string& folder)
+                                             const std::string& folder,
+                                             const std::string& files_from,
+                                             const std::string& control_path)
 {
     std::stringstream ss;
     namespace fs = std::filesystem;
     // format: "[%t]:%o:%f:Last Modified %M\"
     ss << "rsync -arvz --out-format=\"processing: %f\"  "
-       << " -e 'ssh -o UserKnownHostsFile=/dev/null -o StrictHostKeyChecking=no  -i ~/.config/metriffic/" << username << "/keys/user_key  -p " << local_port << "'"
-       << " --progress ";
+       << " -e 'ssh -o UserKnownHostsFile=/dev/null -o StrictHostKeyChecking=no  -i ~/.config/metriffic/" << username << "/keys/user_key ";
+    if(!control_path.empty()) {
+        // the first rsync leaves its ssh connection behind for the next ones.
+        ss << " -o ControlMaster=auto -o ControlPath=" << quote_control_path(control_path) 
+           << " -o ControlPersist=" << SYNC_CONTROL_PERSIST.count() << " ";
+    }
+    if(use_proxy) {
+        // ssh pipes straight into a bastion channel, no local port involved.
+        ss << " -o ProxyCommand=\"" << m_context.program << " proxy " << app_context::RSYNC_PROXY_TARGET 
+           << " -u " << username << "\"'";
+    } else {
+        ss << " -p " << local_port << "'";
+    }
+    ss << " --info=progress2 ";
+    if(enable_delete && !files_from.empty()) {
+        // listed files that are gone locally are deleted on the remote side,
+        // --delete itself needs a recursive transfer.
+        ss << " --delete-missing-args ";
+    } else
     if(enable_delete) {
         ss << " --delete ";
     }       
-    if(!folder.empty()) {
+    if(!folder.empty() && files_from.empty()) {
         ss << "--include='/" << folder << "' --include='/"<<folder<<"/**' --exclude='*' ";
     }        
     if(direction == SYNC_DIR_DOWN) {
         ss << username <<"@localhost: "
            << user_workspace;
     } else 
+    if(direction == SYNC_DIR_UP && !files_from.empty()) {
+        // only the listed files, the list is already limited to the folder.
+        ss << "--files-from='" << files_from << "' "
+           << upload_source(user_workspace).first << " "
+           << username << "@localhost:";
+    } else
     if(direction == SYNC_DIR_UP) {
         ss << user_workspace << " "
            << username << "@localhost:";
@@ -99,17 +184,254 @@ workspace_commands::workspace_show(std::ostream& out)
     }
 }
 
+workspace_commands::upload_plan
+workspace_commands::plan_upload(std::ostream& out,
+                                workspace_manifest& manifest,
+                                const std::string& user_workspace,
+                                const std::string& folder,
+                                bool enable_delete,
+                                bool full)
+{
+    upload_plan plan;
+    out << "scanning workspace... ";
+    plan.tree = m_sync_engine.scan(user_workspace, folder, false);
+    bool known = !full && manifest.load();
+    auto changes = manifest.compare(plan.tree, folder, m_sync_engine);
+    out << plan.tree.files.size() << " files, " << format_bytes(plan.tree.total_bytes);
+    if(known) {
+        out << ", " << changes.modified.size() << " modified, " 
+            << changes.removed.size() << " removed";
+    }
+    out << "." << std::endl;
+    // -d is a full --delete rsync, the remote side may have files that no
+    // manifest knows about (e.g. the output of jobs), or that were removed
+    // locally during an upload without -d.
+    if(!known || enable_delete) {
+        plan.everything = true;
+        plan.needed = true;
+        plan.bytes_total = plan.tree.total_bytes;
+        return plan;
+    }
+    plan.metadata_only = changes.rehashed > 0 || !changes.removed.empty();
+    if(changes.modified.empty()) {
+        return plan;
+    }
+    plan.needed = true;
+    plan.files = changes.modified;
+    for(const auto& f : plan.files) {
+        plan.bytes_total += file_size(plan.tree, f);
+    }
+    return plan;
+}
+
+workspace_commands::upload_plan
+workspace_commands::plan_batch(workspace_manifest& manifest,
+                               const std::string& user_workspace,
+                               const std::set<std::string>& changed,
+                               bool enable_delete)
+{
+    namespace fs = std::filesystem;
+    upload_plan plan;
+    std::vector<std::string> directories;
+    for(const auto& path : changed) {
+        struct stat st;
+        if(::lstat((fs::path(user_workspace) / path).c_str(), &st) != 0) {
+            // without -d the remote side keeps it, so does the manifest.
+            if(enable_delete) {
+                plan.removed.push_back(path);
+            }
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            // only new ones get here, so that empty directories show up too.
+            directories.push_back(path);
+            continue;
+        }
+        sync_engine::file_entry f;
+        f.path = path;
+        f.size = st.st_size;
+        f.mtime = sync_engine::mtime_ns(st);
+        f.inode = st.st_ino;
+        f.symlink = S_ISLNK(st.st_mode);
+        plan.tree.total_bytes += f.size;
+        plan.tree.files.push_back(std::move(f));
+    }
+    // editors rewrite files with the same content, or touch them.
+    auto changes = manifest.compare_files(plan.tree, m_sync_engine);
+    plan.metadata_only = changes.rehashed > 0 || !plan.removed.empty();
+    if(changes.modified.empty() && directories.empty() && plan.removed.empty()) {
+        return plan;
+    }
+    plan.needed = true;
+    plan.files = changes.modified;
+    for(const auto& f : plan.files) {
+        plan.bytes_total += file_size(plan.tree, f);
+    }
+    plan.files.insert(plan.files.end(), directories.begin(), directories.end());
+    return plan;
+}
+
+int
+workspace_commands::run_rsync(std::ostream& out, 
+                              const std::vector<std::string>& commandlines,
+                              uint64_t bytes_total)
+{
+    struct worker
+    {
+        child_process process;
+        std::unique_ptr<sync_engine::rsync_progress_parser> parser;
+        bool done = false;
+    };
+
+    std::string current;
+    auto last_render = std::chrono::steady_clock::time_point();
+    std::vector<worker> workers(commandlines.size());
+    // the workers show up as a single transfer.
+    auto aggregate = [&]() {
+        sync_engine::progress total;
+        total.current = current;
+        for(const auto& w : workers) {
+            if(!w.parser) {
+                continue;
+            }
+            const auto& p = w.parser->state();
+            total.files_done += p.files_done;
+            total.files_total += p.files_total;
+            total.bytes_done += p.bytes_done;
+            // rsync's own estimates, unless the local scan knows better.
+            total.bytes_total += p.bytes_total;
+            if(!w.done) {
+                total.rate += p.rate;
+            }
+        }
+        if(bytes_total > 0) {
+            total.bytes_total = bytes_total;
+        }
+        return total;
+    };
+    auto on_progress = [&](const sync_engine::progress& p) {
+        if(p.current != current) {
+            current = p.current;
+            // wide enough to cover the progress line it replaces.
+            std::string line = "processing: " + current;
+            line.resize(std::max<size_t>(line.size(), SYNC_LINE_WIDTH), ' ');
+            out << "\r" << line << std::endl;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if(now - last_render >= SYNC_PROGRESS_TICK) {
+            last_render = now;
+            print_sync_progress(out, aggregate());
+        }
+    };
+
+    std::vector<struct pollfd> fds;
+    for(size_t i = 0; i < commandlines.size(); ++i) {
+        PLOGV << "rsync commandline: " << commandlines[i];
+        std::string error;
+        if(!workers[i].process.start(commandlines[i], error)) {
+            out << "error: failed to start and instance of rsync: " << error << "." << std::endl;
+            workers[i].done = true;
+            fds.push_back({-1, POLLIN, 0});
+            continue;
+        }
+        workers[i].parser.reset(new sync_engine::rsync_progress_parser(0, on_progress));
+        fds.push_back({workers[i].process.output_fd(), POLLIN, 0});
+    }
+
+    std::vector<char> buffer(SYNC_READ_BUFFER);
+    auto running = std::count_if(fds.begin(), fds.end(), [](const struct pollfd& p) { return p.fd >= 0; });
+    bool canceled = false;
+    while(running > 0) {
+        // the children are in their own process groups, ctrl-c only
+        // interrupts the poll and the cancel is passed on from here.
+        if(!m_context.session.RunningCommand()) {
+            canceled = true;
+            break;
+        }
+        if(poll(fds.data(), fds.size(), SYNC_PROGRESS_TICK.count()) < 0 && errno != EINTR) {
+            PLOGE << "poll failed: " << std::strerror(errno);
+            break;
+        }
+        for(size_t i = 0; i < fds.size(); ++i) {
+            if(fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            // drain the pipe, rsync blocks on a full one.
+            ssize_t n;
+            while((n = workers[i].process.read(buffer.data(), buffer.size())) > 0) {
+                workers[i].parser->feed(buffer.data(), n);
+            }
+            if(n == 0 || errno != EAGAIN) {
+                workers[i].parser->finish();
+                workers[i].done = true;
+                fds[i].fd = -1;
+                --running;
+            }
+        }
+    }
+
+    if(canceled || running > 0) {
+        for(auto& w : workers) {
+            w.process.terminate(SYNC_TERMINATE_GRACE);
+        }
+    }
+    int result = 0;
+    for(auto& w : workers) {
+        int status = w.process.wait();
+        if(result == 0) {
+            result = status;
+        }
+    }
+    auto total = aggregate();
+    if(total.files_total > 0) {
+        print_sync_progress(out, total);
+        out << std::endl;
+    }
+    return result;
+}
+
 void
 workspace_commands::workspace_sync(std::ostream& out, 
                                    bool enable_delete,
+                                   bool use_proxy,
+                                   bool full,
+                                   size_t jobs,
                                    const std::string& direction, 
                                    const std::string& folder)
 {
+    namespace fs = std::filesystem;
+
     if(!m_context.is_logged_in()) {
         out << "please log in first." << std::endl;
         return;
     }
 
+    auto sync_username = m_context.username;
+    auto workspace = m_context.settings.workspace(sync_username);
+    if(workspace.first == false) {
+        out << "error: local workspace for the current user doesn't exist." << std::endl;
+        return;
+    }
+
+    // an upload compares the workspace to what the last one left on the
+    // remote side and hands rsync only the difference, or nothing at all.
+    auto manifest_file = m_context.settings.workspace_manifest_file(sync_username);
+    workspace_manifest manifest(manifest_file, workspace.second);
+    upload_plan plan;
+    std::vector<std::string> lists;
+    if(direction == SYNC_DIR_UP) {
+        plan = plan_upload(out, manifest, workspace.second, folder, enable_delete, full);
+        if(!plan.needed) {
+            if(plan.metadata_only) {
+                // e.g. a touch.
+                manifest.update(plan.tree, folder);
+                manifest.save();
+            }
+            out << "workspace is up to date." << std::endl;
+            return;
+        }
+    }
+
     out<<"requesting access... ";
     int msg_id = m_context.gql_manager.sync_request();
     auto response = m_context.gql_manager.wait_for_response(msg_id);
@@ -118,76 +440,290 @@ workspace_commands::workspace_sync(std::ostream& out,
 
     if(show_msg["payload"]["data"] != nullptr) {
         out<<"done."<<std::endl;
-        auto sync_username = m_context.username;
         bool status = show_msg["payload"]["data"]["rsyncRequest"].get<bool>();
-        out<<"opening ssh tunnel... ";
-        auto tunnel_ret = m_context.ssh.start_rsync_tunnel(sync_username, m_context.settings.bastion_key_file(sync_username));
+        if(!use_proxy) {
+            out<<"opening ssh tunnel... ";
+        }
+        // with the proxy every ssh started by rsync opens its own channel.
+        auto tunnel_ret = use_proxy ? ssh_manager::ssh_tunnel_ret(true) :
+                          m_context.ssh.start_rsync_tunnel(sync_username, m_context.settings.bastion_key_file(sync_username));
         if(tunnel_ret.status) {
-            out<<"done."<<std::endl;
-
-            auto workspace = m_context.settings.workspace(sync_username);
+            if(!use_proxy) {
+                out<<"done."<<std::endl;
+            }
 
-            if(workspace.first == false) {
-                out << "error: local workspace for the current user doesn't exist." << std::endl;
-                return;
+            // an upload may be split into lists of about the same size, one
+            // rsync each, so that compression runs on as many cores.
+            lists = direction == SYNC_DIR_UP ?
+                    write_upload_lists(plan, manifest_file + ".files", workspace.second, jobs, enable_delete) :
+                    std::vector<std::string>{""};
+            if(lists.size() > 1) {
+                out << "uploading with " << lists.size() << " rsync workers..." << std::endl;
             }
-            std::string commandline = build_rsynch_commandline(out, sync_username, 
-                                                               tunnel_ret.dest_host, tunnel_ret.local_port,
-                                                               enable_delete, direction, workspace.second, folder);
-                                                                           
-            PLOGV << "rsync commandline: " << commandline;                                                                           
-            std::array<char, 32> buffer;
-            std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(commandline.c_str(), "r"), pclose);
-            if (!pipe) {
-                out << "error: failed to start and instance of rsync." << std::endl;
-                return;
+            std::vector<std::string> commandlines;
+            for(const auto& l : lists) {
+                commandlines.push_back(build_rsynch_commandline(out, sync_username, 
+                                                                tunnel_ret.dest_host, tunnel_ret.local_port,
+                                                                use_proxy, enable_delete, direction, workspace.second, folder,
+                                                                l, ""));
             }
-
-            std::stringstream rsss;
-            int i = 0;
-            while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-                std::string strbuf(buffer.data());
-                auto len = strlen(buffer.data());
-                std::string delimiter = "\r\n";
-                std::size_t pos = 0;
-                while ((pos = strbuf.find_first_of(delimiter)) != std::string::npos) {
-
-                    std::string full_str = rsss.str() + strbuf.substr(0, pos + 1);
-                    std::size_t xpos = full_str.find("(xfr#");
-                    std::string filtered_str = full_str.substr(0,xpos);
-
-                    if(strbuf[pos] == '\n') {
-                        out << filtered_str;
-                        if(xpos != std::string::npos) {
-                            out << std::endl;
-                        }
-                    } else 
-                    if(strbuf[pos] == '\r') {                    
-                        out << filtered_str << std::flush;
+            int exit_status = run_rsync(out, commandlines, plan.bytes_total);
+            if(m_context.session.RunningCommand()) {
+                if(exit_status == 0) {
+                    if(direction == SYNC_DIR_UP) {
+                        manifest.update(plan.tree, folder);
+                        manifest.save();
+                    } else {
+                        // downloaded files may no longer match what was uploaded.
+                        manifest.clear();
                     }
-                    rsss.str("");
-                    strbuf.erase(0, pos + 1);
+                    out<<"sync complete..."<<std::endl;
+                } else {
+                    out<<"sync failed, rsync exited with status " << exit_status << "..." << std::endl;
                 }
-                rsss << strbuf;
-            }
-            if(m_context.session.RunningCommand()) {
-                out<<"sync complete..."<<std::endl;
             } else {
                 out<<"sync canceled..."<<std::endl;
             }
         } else {
             out<<"failed."<<std::endl;
         }
-        m_context.ssh.stop_rsync_tunnel(sync_username);
-        out<<"stopping ssh tunnel. "<<std::endl;
+        if(!use_proxy) {
+            m_context.ssh.stop_rsync_tunnel(sync_username);
+            out<<"stopping ssh tunnel. "<<std::endl;
+        }
     } else 
     if(show_msg["payload"].contains("errors") ) {
         out<<"failed."<<std::endl;
         PLOGE << "workspace syncrhonization request failed: " << show_msg["payload"]["errors"].dump(4);
     }
+    remove_upload_lists(lists);
 }
 
+void
+workspace_commands::workspace_watch(std::ostream& out,
+                                    bool enable_delete,
+                                    bool use_proxy,
+                                    const std::string& folder)
+{
+    namespace fs = std::filesystem;
+
+    if(!m_context.is_logged_in()) {
+        out << "please log in first." << std::endl;
+        return;
+    }
+
+    auto sync_username = m_context.username;
+    auto workspace = m_context.settings.workspace(sync_username);
+    if(workspace.first == false) {
+        out << "error: local workspace for the current user doesn't exist." << std::endl;
+        return;
+    }
 
+    // watching starts before the first upload, so that nothing edited in
+    // between is missed.
+    workspace_watcher watcher(workspace.second, folder);
+    std::string error;
+    if(!watcher.start(error)) {
+        out << "error: " << error << "." << std::endl;
+        return;
+    }
+
+    out<<"requesting access... ";
+    int msg_id = m_context.gql_manager.sync_request();
+    auto response = m_context.gql_manager.wait_for_response(msg_id);
+    PLOGV << "rsync response: " << std::endl << response.second.dump(4);
+    nlohmann::json show_msg = response.second;
+    if(show_msg["payload"]["data"] == nullptr) {
+        out<<"failed."<<std::endl;
+        if(show_msg["payload"].contains("errors") ) {
+            PLOGE << "workspace syncrhonization request failed: " << show_msg["payload"]["errors"].dump(4);
+        }
+        return;
+    }
+    out<<"done."<<std::endl;
+
+    // one tunnel and one ssh connection for the whole watch, each batch
+    // only pays for starting rsync.
+    if(!use_proxy) {
+        out<<"opening ssh tunnel... ";
+    }
+    auto tunnel_ret = use_proxy ? ssh_manager::ssh_tunnel_ret(true) :
+                      m_context.ssh.start_rsync_tunnel(sync_username, m_context.settings.bastion_key_file(sync_username));
+    if(!tunnel_ret.status) {
+        out<<"failed."<<std::endl;
+        return;
+    }
+    if(!use_proxy) {
+        out<<"done."<<std::endl;
+    }
+
+    auto manifest_file = m_context.settings.workspace_manifest_file(sync_username);
+    auto list_file = manifest_file + ".files";
+    auto control_path = fs::path(manifest_file).parent_path() / "ssh-control";
+    workspace_manifest manifest(manifest_file, workspace.second);
+
+    auto push = [&](const upload_plan& plan, bool whole) {
+        // batches are small, one rsync is enough.
+        auto lists = write_upload_lists(plan, list_file, workspace.second, 1, enable_delete);
+        std::vector<std::string> commandlines;
+        for(const auto& l : lists) {
+            commandlines.push_back(build_rsynch_commandline(out, sync_username,
+                                                            tunnel_ret.dest_host, tunnel_ret.local_port,
+                                                            use_proxy, enable_delete, SYNC_DIR_UP, workspace.second, folder,
+                                                            l, control_path));
+        }
+        int exit_status = run_rsync(out, commandlines, plan.bytes_total);
+        remove_upload_lists(lists);
+        if(exit_status != 0) {
+            if(m_context.session.RunningCommand()) {
+                out << "upload failed, rsync exited with status " << exit_status << "..." << std::endl;
+            }
+            // nothing gets recorded, the next batch or rescan retries.
+            return false;
+        }
+        if(whole) {
+            manifest.update(plan.tree, folder);
+        } else {
+            manifest.record(plan.tree, plan.removed);
+        }
+        manifest.save();
+        return true;
+    };
+    auto push_all = [&]() {
+        auto plan = plan_upload(out, manifest, workspace.second, folder, enable_delete, false);
+        if(plan.needed) {
+            push(plan, true);
+        } else
+        if(plan.metadata_only) {
+            manifest.update(plan.tree, folder);
+            manifest.save();
+        }
+    };
+
+    push_all();
+    out << "watching " << fs::path(workspace.second) / folder
+        << " for changes, ctrl-c to stop..." << std::endl;
+    while(m_context.session.RunningCommand()) {
+        bool overflow = false;
+        auto changed = watcher.wait(WATCH_POLL_INTERVAL, WATCH_QUIET_PERIOD, WATCH_MAX_DELAY, overflow);
+        if(!m_context.session.RunningCommand()) {
+            break;
+        }
+        if(overflow) {
+            out << "too many changes at once, rescanning..." << std::endl;
+            push_all();
+            continue;
+        }
+        if(changed.empty()) {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto plan = plan_batch(manifest, workspace.second, changed, enable_delete);
+        if(!plan.needed) {
+            if(plan.metadata_only) {
+                manifest.record(plan.tree, plan.removed);
+                manifest.save();
+            }
+            continue;
+        }
+        if(push(plan, false)) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            out << "uploaded " << format_bytes(plan.bytes_total) << " in " << ms.count() << " ms." << std::endl;
+        }
+    }
+
+    // no shell in between, the path is passed as it is.
+    child_process stop_master;
+    if(!stop_master.start({"ssh", "-q", "-o", "ControlPath=" + ssh_token_escape(control_path.string()), 
+                           "-O", "exit", "localhost"}, error) || stop_master.wait() != 0) {
+        PLOGV << "no ssh connection left to stop";
+    }
+    if(!use_proxy) {
+        m_context.ssh.stop_rsync_tunnel(sync_username);
+        out<<"stopping ssh tunnel. "<<std::endl;
+    }
+    out << "watch stopped..." << std::endl;
+}
+
+uint64_t
+workspace_commands::file_size(const sync_engine::scan_result& tree, const std::string& path)
+{
+    auto it = std::lower_bound(tree.files.begin(), tree.files.end(), path,
+        [](const sync_engine::file_entry& e, const std::string& p) { return e.path < p; });
+    return it != tree.files.end() && it->path == path ? it->size : 0;
+}
+
+std::vector<std::string>
+workspace_commands::write_upload_lists(const upload_plan& plan,
+                                       const std::string& list_file,
+                                       const std::string& user_workspace,
+                                       size_t jobs,
+                                       bool enable_delete)
+{
+    // deletions need rsync to compare the whole folder.
+    if(plan.everything && (jobs <= 1 || enable_delete)) {
+        return {""};
+    }
+
+    std::vector<std::string> files;
+    std::vector<uint64_t> sizes;
+    if(plan.everything) {
+        for(const auto& f : plan.tree.files) {
+            files.push_back(f.path);
+            sizes.push_back(f.size);
+        }
+    } else {
+        files = plan.files;
+        for(const auto& f : files) {
+            sizes.push_back(file_size(plan.tree, f));
+        }
+    }
+    jobs = std::max<size_t>(1, std::min(jobs, files.size()));
+    auto buckets = sync_engine::balance(sizes, jobs);
+
+    // the names are relative to the source directory rsync is given, see
+    // build_rsynch_commandline().
+    auto prefix = upload_source(user_workspace).second;
+    std::vector<std::string> names;
+    std::vector<std::ofstream> lists;
+    for(size_t i = 0; i < jobs; ++i) {
+        names.push_back(list_file + "." + std::to_string(i));
+        lists.emplace_back(names.back(), std::ios::trunc);
+    }
+    for(size_t i = 0; i < files.size(); ++i) {
+        lists[buckets[i]] << prefix << files[i] << "\n";
+    }
+    if(enable_delete) {
+        for(const auto& f : plan.removed) {
+            lists[0] << prefix << f << "\n";
+        }
+    }
+    return names;
+}
+
+void
+workspace_commands::remove_upload_lists(const std::vector<std::string>& lists)
+{
+    for(const auto& l : lists) {
+        if(!l.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(l, ec);
+        }
+    }
+}
+
+std::pair<std::string, std::string>
+workspace_commands::upload_source(const std::string& user_workspace)
+{
+    namespace fs = std::filesystem;
+    // "dir/" uploads the content of dir, "dir" uploads dir itself.
+    if(!user_workspace.empty() && user_workspace.back() == fs::path::preferred_separator) {
+        return {user_workspace, ""};
+    }
+    fs::path p(user_workspace);
+    return {p.parent_path().string() + fs::path::preferred_separator,
+            p.filename().string() + "/"};
+}
 
 std::shared_ptr<cli::Command> 
 workspace_commands::create_sync_cmd()
@@ -201,7 +737,10 @@ workspace_commands::create_sync_cmd()
                 ("command", CMD_WORKSPACE_PARAMDESC[0], cxxopts::value<std::string>())
                 ("direction", CMD_WORKSPACE_PARAMDESC[1], cxxopts::value<std::string>())
                 ("f, folder", CMD_WORKSPACE_PARAMDESC[2], cxxopts::value<std::string>())
-                ("d, delete", CMD_WORKSPACE_PARAMDESC[3], cxxopts::value<bool>()->default_value("false"));
+                ("d, delete", CMD_WORKSPACE_PARAMDESC[3], cxxopts::value<bool>()->default_value("false"))
+                ("p, proxy", CMD_WORKSPACE_PARAMDESC[4], cxxopts::value<bool>()->default_value("false"))
+                ("full", CMD_WORKSPACE_PARAMDESC[5], cxxopts::value<bool>()->default_value("false"))
+                ("j, jobs", CMD_WORKSPACE_PARAMDESC[6], cxxopts::value<unsigned int>()->default_value("1"));
 
             options.parse_positional({"command", "direction"});
 
@@ -209,7 +748,8 @@ workspace_commands::create_sync_cmd()
                 auto result = options.parse(argc, argv);
                 if(result.count("command") != 1) {
                     out << CMD_WORKSPACE_NAME << ": 'command' (either '"
-                        << WORKSPACE_SET_CMD << ", " << WORKSPACE_SHOW_CMD << "' or '" << WORKSPACE_SYNC_CMD
+                        << WORKSPACE_SET_CMD << ", " << WORKSPACE_SHOW_CMD << ", " << WORKSPACE_WATCH_CMD 
+                        << "' or '" << WORKSPACE_SYNC_CMD
                         << "') is a mandatory argument." << std::endl;
                     return;
                 }
@@ -247,12 +787,28 @@ workspace_commands::create_sync_cmd()
                     if(result.count("delete")) {
                         enable_delete = result["delete"].as<bool>();
                     }
-                    workspace_sync(out, enable_delete, direction, folder);
+                    bool use_proxy = result["proxy"].as<bool>();
+                    bool full = result["full"].as<bool>();
+                    auto jobs = result["jobs"].as<unsigned int>();
+                    if(jobs == 0) {
+                        out << CMD_WORKSPACE_NAME << ": '-j|--jobs' must be at least 1." << std::endl;
+                        return;
+                    }
+                    workspace_sync(out, enable_delete, use_proxy, full, jobs, direction, folder);
 
+                } else 
+                if(command == WORKSPACE_WATCH_CMD) {
+                    std::string folder = "";
+                    if(result.count("folder")) {
+                        folder = result["folder"].as<std::string>();
+                    }
+                    bool enable_delete = result["delete"].as<bool>();
+                    bool use_proxy = result["proxy"].as<bool>();
+                    workspace_watch(out, enable_delete, use_proxy, folder);
                 } else {
                     out << CMD_WORKSPACE_NAME << ": unsupported command, "
                         << "supported types are: '"<< WORKSPACE_SET_CMD << "', '" << WORKSPACE_SHOW_CMD 
-                        << "', '" << WORKSPACE_SYNC_CMD << "'." << std::endl;
+                        << "', '" << WORKSPACE_SYNC_CMD << "', '" << WORKSPACE_WATCH_CMD << "'." << std::endl;
                     return;
                 }
 
@@ -3,9 +3,13 @@
 
 #include <string>
 #include <memory>
+#include <chrono>
+#include <set>
 #include <cli/cli.h>
 
 #include "app_context.hpp"
+#include "sync_engine.hpp"
+#include "workspace_manifest.hpp"
 
 namespace metriffic
 {
@@ -21,37 +25,110 @@ public:
     void workspace_show(std::ostream& out);
     void workspace_sync(std::ostream& out, 
                         bool enable_delete,
+                        bool use_proxy,
+                        bool full,
+                        size_t jobs,
                         const std::string& direction, 
                         const std::string& folder);
+    // uploads every change under the workspace as it happens, until canceled.
+    void workspace_watch(std::ostream& out,
+                         bool enable_delete,
+                         bool use_proxy,
+                         const std::string& folder);
 
 private:
+    struct upload_plan
+    {
+        // the files looked at, with their digests.
+        sync_engine::scan_result tree;
+        // what to upload and, with -d, what to delete on the remote side.
+        std::vector<std::string> files;
+        std::vector<std::string> removed;
+        // nothing is known about the remote side, or -d asks rsync to
+        // compare it to the whole workspace, every file goes to rsync.
+        bool everything = false;
+        uint64_t bytes_total = 0;
+        // there is something to upload.
+        bool needed = false;
+        // nothing to upload, but the manifest is stale.
+        bool metadata_only = false;
+    };
+
+    // compares the workspace (or its folder) to the manifest.
+    upload_plan plan_upload(std::ostream& out,
+                            workspace_manifest& manifest,
+                            const std::string& user_workspace,
+                            const std::string& folder,
+                            bool enable_delete,
+                            bool full);
+    // compares the paths reported by the watcher to the manifest.
+    upload_plan plan_batch(workspace_manifest& manifest,
+                           const std::string& user_workspace,
+                           const std::set<std::string>& changed,
+                           bool enable_delete);
+    // runs the rsyncs side by side and shows them as one transfer. Returns
+    // the first failed exit status, -1 if one didn't run or was killed.
+    int run_rsync(std::ostream& out, 
+                  const std::vector<std::string>& commandlines,
+                  uint64_t bytes_total);
+
     void print_sync_usage(std::ostream& out);
+    void print_sync_progress(std::ostream& out, const sync_engine::progress& p);
     std::string build_rsynch_commandline(std::ostream& out,
                                          const std::string& username, 
                                          const std::string& dest_host,
                                          unsigned int local_port,
+                                         bool use_proxy,
                                          bool enable_delete,
                                          const std::string& direction,
                                          const std::string& user_workspace,
-                                         const std::string& folder);
+                                         const std::string& folder,
+                                         const std::string& files_from,
+                                         const std::string& control_path);
+    // splits an upload into up to 'jobs' rsync --files-from lists of about
+    // the same size. An empty name stands for a plain rsync of the folder.
+    std::vector<std::string> write_upload_lists(const upload_plan& plan,
+                                                const std::string& list_file,
+                                                const std::string& user_workspace,
+                                                size_t jobs,
+                                                bool enable_delete);
+    void remove_upload_lists(const std::vector<std::string>& lists);
+    uint64_t file_size(const sync_engine::scan_result& tree, const std::string& path);
+    // the source directory of an upload and the prefix of the names in it.
+    std::pair<std::string, std::string> upload_source(const std::string& user_workspace);
 
 private: 
     app_context& m_context;
+    sync_engine m_sync_engine;
 
     const std::string WORKSPACE_SET_CMD = "set";
     const std::string WORKSPACE_SHOW_CMD = "show";
     const std::string WORKSPACE_SYNC_CMD = "sync";
+    const std::string WORKSPACE_WATCH_CMD = "watch";
     
     const std::string SYNC_DIR_UP = "up";
     const std::string SYNC_DIR_DOWN = "down";
+    const std::chrono::milliseconds SYNC_PROGRESS_TICK = std::chrono::milliseconds(250);
+    const size_t SYNC_LINE_WIDTH = 100;
+    const size_t SYNC_READ_BUFFER = 64 * 1024;
+    const std::chrono::milliseconds SYNC_TERMINATE_GRACE = std::chrono::milliseconds(2000);
+    const std::chrono::seconds SYNC_CONTROL_PERSIST = std::chrono::seconds(300);
+    // a batch goes out once the changes stop for the quiet period, but no
+    // later than the max delay after the first one.
+    const std::chrono::milliseconds WATCH_POLL_INTERVAL = std::chrono::milliseconds(250);
+    const std::chrono::milliseconds WATCH_QUIET_PERIOD = std::chrono::milliseconds(50);
+    const std::chrono::milliseconds WATCH_MAX_DELAY = std::chrono::milliseconds(300);
 
     const std::string CMD_WORKSPACE_NAME = "workspace";
     const std::string CMD_WORKSPACE_HELP = "managing workspace";//"synchronize files between the local folder and remote workspace...";
     const std::vector<std::string> CMD_WORKSPACE_PARAMDESC = {
-        {"<command>: mandatory argument, workspace command to execute. Can be either 'sync', 'set' or 'show'"},
+        {"<command>: mandatory argument, workspace command to execute. Can be either 'sync', 'watch', 'set' or 'show'"},
         {"   <direction>: mandatory for 'sync' command, the direction of file synchronization. Can be either 'up' or 'down'"},
-        {"   -f|--folder <name of the local folder>: command option for 'sync' (path to the local subfolder to synchronize) or 'set (new folder for workspace)'."},
-        {"   -d|--delete: command option for 'sync', enable deletion of extraneous files from the receiving side."},
+        {"   -f|--folder <name of the local folder>: command option for 'sync' (path to the local subfolder to synchronize), 'watch' (subfolder to watch) or 'set (new folder for workspace)'."},
+        {"   -d|--delete: command option for 'sync' and 'watch', enable deletion of extraneous files from the receiving side."},
+        {"   -p|--proxy: command option for 'sync' and 'watch', run ssh through 'metriffic proxy' instead of a local tunnel port."},
+        {"   --full: command option for 'sync up', ignore what the last upload recorded and let rsync compare the whole workspace."},
+        {"   -j|--jobs <N>: command option for 'sync up', split the upload between N rsync workers of about the same size (default 1)."},
     };
 };
 
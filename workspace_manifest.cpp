@@ -0,0 +1,303 @@
+#include "workspace_manifest.hpp"
+#include <plog/Log.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace fs = std::filesystem;
+
+namespace metriffic
+{
+
+namespace
+{
+    // file layout, little endian as written by the host:
+    //   magic, version, workspace, entry count, then per entry
+    //   path, size, mtime, inode, digest (raw, 0 or 32 bytes).
+    const char MANIFEST_MAGIC[4] = {'M', 'T', 'F', 'M'};
+    const uint32_t MANIFEST_VERSION = 1;
+    // path length, size, mtime, inode and digest length.
+    const size_t MIN_ENTRY_SIZE = 4 + 8 + 8 + 8 + 1;
+
+    template<typename T>
+    void
+    put(std::string& out, T v)
+    {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    void
+    put_string(std::string& out, const std::string& s)
+    {
+        put<uint32_t>(out, s.size());
+        out.append(s);
+    }
+
+    class reader
+    {
+    public:
+        reader(const std::string& data) : m_data(data) {}
+
+        template<typename T>
+        bool get(T& v)
+        {
+            if(m_data.size() - m_pos < sizeof(v)) {
+                return false;
+            }
+            std::copy_n(m_data.data() + m_pos, sizeof(v), reinterpret_cast<char*>(&v));
+            m_pos += sizeof(v);
+            return true;
+        }
+
+        bool get_string(std::string& s, uint32_t size)
+        {
+            if(m_data.size() - m_pos < size) {
+                return false;
+            }
+            s.assign(m_data, m_pos, size);
+            m_pos += size;
+            return true;
+        }
+
+        bool get_string(std::string& s)
+        {
+            uint32_t size;
+            return get(size) && get_string(s, size);
+        }
+
+        bool done() const { return m_pos == m_data.size(); }
+        size_t left() const { return m_data.size() - m_pos; }
+
+    private:
+        const std::string& m_data;
+        size_t m_pos = 0;
+    };
+
+    std::string
+    digest_to_raw(const std::string& hex)
+    {
+        std::string raw(hex.size() / 2, '\0');
+        for(size_t i = 0; i < raw.size(); ++i) {
+            raw[i] = char(std::stoi(hex.substr(2 * i, 2), nullptr, 16));
+        }
+        return raw;
+    }
+
+    std::string
+    raw_to_digest(const std::string& raw)
+    {
+        static const char* HEX = "0123456789abcdef";
+        std::string hex(raw.size() * 2, '0');
+        for(size_t i = 0; i < raw.size(); ++i) {
+            unsigned char c = raw[i];
+            hex[2 * i] = HEX[c >> 4];
+            hex[2 * i + 1] = HEX[c & 0xf];
+        }
+        return hex;
+    }
+}
+
+workspace_manifest::workspace_manifest(const fs::path& file, const std::string& workspace)
+ : m_file(file),
+   m_workspace(workspace)
+{}
+
+bool
+workspace_manifest::load()
+{
+    m_entries.clear();
+    std::ifstream in(m_file, std::ios::binary);
+    if(!in) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    reader r(data);
+    std::string magic, workspace;
+    uint32_t version = 0;
+    uint64_t count = 0;
+    // a count the rest of the file can't hold is as unreadable as a bad
+    // magic, it must not get to reserve().
+    if(!r.get_string(magic, sizeof(MANIFEST_MAGIC)) ||
+       magic != std::string(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) ||
+       !r.get(version) || version != MANIFEST_VERSION ||
+       !r.get_string(workspace) || !r.get(count) || count > r.left() / MIN_ENTRY_SIZE) {
+        PLOGW << "ignoring unreadable workspace manifest " << m_file;
+        return false;
+    }
+    if(workspace != m_workspace) {
+        // the workspace was moved, nothing in there applies.
+        PLOGV << "workspace manifest " << m_file << " is for " << workspace;
+        return false;
+    }
+    m_entries.reserve(count);
+    for(uint64_t i = 0; i < count; ++i) {
+        std::string path, raw;
+        entry e;
+        uint8_t digest_size;
+        if(!r.get_string(path) || !r.get(e.size) || !r.get(e.mtime) || !r.get(e.inode) ||
+           !r.get(digest_size) || !r.get_string(raw, digest_size)) {
+            PLOGW << "ignoring truncated workspace manifest " << m_file;
+            m_entries.clear();
+            return false;
+        }
+        e.digest = raw_to_digest(raw);
+        m_entries.emplace(std::move(path), std::move(e));
+    }
+    PLOGV << "loaded workspace manifest " << m_file << ": " << m_entries.size() << " files";
+    return r.done();
+}
+
+bool
+workspace_manifest::save() const
+{
+    std::string data;
+    data.reserve(64 + m_entries.size() * 96);
+    data.append(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    put(data, MANIFEST_VERSION);
+    put_string(data, m_workspace);
+    put<uint64_t>(data, m_entries.size());
+    for(const auto& [path, e] : m_entries) {
+        put_string(data, path);
+        put(data, e.size);
+        put(data, e.mtime);
+        put(data, e.inode);
+        auto raw = digest_to_raw(e.digest);
+        put<uint8_t>(data, raw.size());
+        data.append(raw);
+    }
+
+    // a crash halfway must not leave a manifest that claims a synced state.
+    auto tmp = m_file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size());
+        if(!out.flush()) {
+            PLOGE << "failed to write workspace manifest " << tmp;
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, m_file, ec);
+    if(ec) {
+        PLOGE << "failed to replace workspace manifest " << m_file << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+void
+workspace_manifest::clear()
+{
+    m_entries.clear();
+    std::error_code ec;
+    fs::remove(m_file, ec);
+}
+
+bool
+workspace_manifest::in_folder(const std::string& path, const std::string& folder)
+{
+    return folder.empty() ||
+           (path.size() > folder.size() &&
+            path.compare(0, folder.size(), folder) == 0 &&
+            path[folder.size()] == '/');
+}
+
+workspace_manifest::changes
+workspace_manifest::compare(sync_engine::scan_result& scan, const std::string& folder,
+                            const sync_engine& engine) const
+{
+    changes result = compare_files(scan, engine);
+    for(const auto& [path, e] : m_entries) {
+        if(!in_folder(path, folder)) {
+            continue;
+        }
+        auto found = std::lower_bound(scan.files.begin(), scan.files.end(), path,
+            [](const sync_engine::file_entry& f, const std::string& p) { return f.path < p; });
+        if(found == scan.files.end() || found->path != path) {
+            result.removed.push_back(path);
+        }
+    }
+    std::sort(result.removed.begin(), result.removed.end());
+    return result;
+}
+
+workspace_manifest::changes
+workspace_manifest::compare_files(sync_engine::scan_result& scan, const sync_engine& engine) const
+{
+    changes result;
+
+    // only the files whose metadata moved get read.
+    std::vector<size_t> suspects;
+    for(size_t i = 0; i < scan.files.size(); ++i) {
+        auto& f = scan.files[i];
+        auto it = m_entries.find(f.path);
+        if(it != m_entries.end() &&
+           it->second.size == f.size && it->second.mtime == f.mtime && it->second.inode == f.inode) {
+            f.digest = it->second.digest;
+        } else {
+            suspects.push_back(i);
+        }
+    }
+    result.rehashed = suspects.size();
+    auto errors = engine.hash(m_workspace, scan.files, suspects);
+    for(const auto& e : errors) {
+        PLOGW << "workspace manifest: " << e;
+    }
+    for(auto i : suspects) {
+        const auto& f = scan.files[i];
+        auto it = m_entries.find(f.path);
+        if(it == m_entries.end() || f.digest.empty() || f.digest != it->second.digest) {
+            result.modified.push_back(f.path);
+        }
+    }
+    return result;
+}
+
+void
+workspace_manifest::update(const sync_engine::scan_result& scan, const std::string& folder)
+{
+    for(auto it = m_entries.begin(); it != m_entries.end(); ) {
+        if(in_folder(it->first, folder)) {
+            it = m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    add(scan);
+}
+
+void
+workspace_manifest::add(const sync_engine::scan_result& scan)
+{
+    m_entries.reserve(m_entries.size() + scan.files.size());
+    for(const auto& f : scan.files) {
+        entry e;
+        e.size = f.size;
+        e.mtime = f.mtime;
+        e.inode = f.inode;
+        e.digest = f.digest;
+        m_entries[f.path] = std::move(e);
+    }
+}
+
+void
+workspace_manifest::record(const sync_engine::scan_result& files, const std::vector<std::string>& removed)
+{
+    for(const auto& path : removed) {
+        if(m_entries.erase(path) == 0) {
+            // not a file, maybe a directory.
+            for(auto it = m_entries.begin(); it != m_entries.end(); ) {
+                if(in_folder(it->first, path)) {
+                    it = m_entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+    add(files);
+}
+
+} // namespace metriffic
@@ -0,0 +1,73 @@
+#ifndef WORKSPACE_MANIFEST_HPP
+#define WORKSPACE_MANIFEST_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <filesystem>
+
+#include "sync_engine.hpp"
+
+namespace metriffic
+{
+
+// the state of the workspace files as of the last successful 'sync up',
+// kept in the per-user settings directory. A sync compares a fresh scan to
+// it and hands rsync only what changed, or skips the sync altogether.
+class workspace_manifest
+{
+public:
+    struct changes
+    {
+        // new files and files with a different content.
+        std::vector<std::string> modified;
+        // files that are gone since the last sync.
+        std::vector<std::string> removed;
+        // files that had to be hashed, the manifest is stale if any.
+        size_t rehashed = 0;
+        bool empty() const { return modified.empty() && removed.empty(); }
+    };
+
+    workspace_manifest(const std::filesystem::path& file, const std::string& workspace);
+
+    // false if there is no usable manifest for this workspace.
+    bool load();
+    bool save() const;
+    // forgets the synced state, the next sync goes over the whole workspace.
+    void clear();
+    bool empty() const { return m_entries.empty(); }
+
+    // compares a scan of the workspace (or of its folder) to the manifest.
+    // Files whose size, mtime or inode changed are hashed and count as
+    // modified only if the content differs, the digests end up in the scan.
+    changes compare(sync_engine::scan_result& scan, const std::string& folder,
+                    const sync_engine& engine) const;
+    // the same for some files only, nothing counts as removed.
+    changes compare_files(sync_engine::scan_result& files, const sync_engine& engine) const;
+    // records the scan of the workspace (or of its folder) as synced.
+    void update(const sync_engine::scan_result& scan, const std::string& folder);
+    // records some files as synced, a removed directory takes its files along.
+    void record(const sync_engine::scan_result& files, const std::vector<std::string>& removed);
+
+private:
+    struct entry
+    {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t inode = 0;
+        std::string digest;
+    };
+
+    void add(const sync_engine::scan_result& scan);
+    static bool in_folder(const std::string& path, const std::string& folder);
+
+private:
+    const std::filesystem::path m_file;
+    const std::string m_workspace;
+    std::unordered_map<std::string, entry> m_entries;
+};
+
+} // namespace metriffic
+
+#endif //WORKSPACE_MANIFEST_HPP
@@ -0,0 +1,182 @@
+#include "workspace_watcher.hpp"
+#include <plog/Log.h>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace metriffic
+{
+
+#ifdef __linux__
+namespace
+{
+    const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                IN_DELETE | IN_ATTRIB | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+    std::string
+    join(const std::string& dir, const std::string& name)
+    {
+        return dir.empty() ? name : dir + "/" + name;
+    }
+}
+#endif
+
+workspace_watcher::workspace_watcher(const fs::path& root, const std::string& folder)
+ : m_root(root),
+   m_folder(folder)
+{}
+
+workspace_watcher::~workspace_watcher()
+{
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool
+workspace_watcher::start(std::string& error)
+{
+#ifdef __linux__
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_fd < 0) {
+        error = std::string("inotify: ") + std::strerror(errno);
+        return false;
+    }
+    add_watches(m_folder, nullptr);
+    if(m_dirs.empty()) {
+        error = "failed to watch " + (m_root / m_folder).string();
+        return false;
+    }
+    PLOGV << "watching " << m_dirs.size() << " directories under " << m_root / m_folder;
+    return true;
+#else
+    error = "watching a workspace is only supported on linux";
+    return false;
+#endif
+}
+
+void
+workspace_watcher::add_watches(const std::string& dir, std::set<std::string>* changed)
+{
+#ifdef __linux__
+    int wd = inotify_add_watch(m_fd, (m_root / dir).c_str(), WATCH_MASK);
+    if(wd < 0) {
+        // ENOSPC is the per-user watch limit, fs.inotify.max_user_watches.
+        PLOGW << "failed to watch " << m_root / dir << ": " << std::strerror(errno);
+        return;
+    }
+    m_dirs[wd] = dir;
+
+    std::error_code ec;
+    fs::directory_iterator it(m_root / dir, ec), end;
+    for(; !ec && it != end; it.increment(ec)) {
+        auto name = join(dir, it->path().filename().string());
+        std::error_code sec;
+        if(it->is_directory(sec) && !it->is_symlink(sec)) {
+            add_watches(name, changed);
+        } else
+        if(changed) {
+            changed->insert(name);
+        }
+    }
+    if(changed) {
+        changed->insert(dir);
+    }
+#endif
+}
+
+bool
+workspace_watcher::read_events(std::set<std::string>& changed, bool& overflow)
+{
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool any = false;
+    while(true) {
+        ssize_t n = read(m_fd, buffer, sizeof(buffer));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for(char* p = buffer; p < buffer + n; ) {
+            auto event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            any = true;
+            if(event->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            auto dir = m_dirs.find(event->wd);
+            if(dir == m_dirs.end()) {
+                continue;
+            }
+            if(event->mask & IN_IGNORED) {
+                // the directory itself is gone, its parent reports that.
+                m_dirs.erase(dir);
+                continue;
+            }
+            if(event->len == 0) {
+                continue;
+            }
+            auto name = join(dir->second, event->name);
+            if(!(event->mask & IN_ISDIR)) {
+                changed.insert(name);
+            } else
+            if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                add_watches(name, &changed);
+            } else
+            if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                changed.insert(name);
+            }
+            // the attributes of an existing directory don't count, an upload
+            // of it would send its whole tree again.
+        }
+    }
+    return any;
+#else
+    return false;
+#endif
+}
+
+std::set<std::string>
+workspace_watcher::wait(std::chrono::milliseconds timeout,
+                        std::chrono::milliseconds quiet,
+                        std::chrono::milliseconds max_delay,
+                        bool& overflow)
+{
+    typedef std::chrono::steady_clock clock;
+    std::set<std::string> changed;
+    overflow = false;
+    if(m_fd < 0) {
+        return changed;
+    }
+
+    struct pollfd pfd = {m_fd, POLLIN, 0};
+    // a signal (e.g. the ctrl-c canceling the command) ends the wait.
+    if(poll(&pfd, 1, timeout.count()) <= 0 || !read_events(changed, overflow)) {
+        return changed;
+    }
+    // an editor saving a file or a build writing a tree is a burst of
+    // events, they go out together once the burst is over.
+    auto deadline = clock::now() + max_delay;
+    while(true) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now());
+        if(left.count() <= 0) {
+            break;
+        }
+        if(poll(&pfd, 1, std::min(quiet, left).count()) <= 0 ||
+           !read_events(changed, overflow)) {
+            break;
+        }
+    }
+    return changed;
+}
+
+} // namespace metriffic
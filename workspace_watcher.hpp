@@ -0,0 +1,52 @@
+#ifndef WORKSPACE_WATCHER_HPP
+#define WORKSPACE_WATCHER_HPP
+
+#include <string>
+#include <set>
+#include <chrono>
+#include <unordered_map>
+#include <filesystem>
+
+namespace metriffic
+{
+
+// reports the paths that change under a workspace (or a folder of it), in
+// batches. Built on inotify, so only available on linux.
+class workspace_watcher
+{
+public:
+    workspace_watcher(const std::filesystem::path& root, const std::string& folder);
+    ~workspace_watcher();
+    workspace_watcher(const workspace_watcher&) = delete;
+    workspace_watcher& operator=(const workspace_watcher&) = delete;
+
+    // watches every directory, also the ones created later.
+    bool start(std::string& error);
+
+    // waits up to 'timeout' for a change, then keeps collecting until
+    // nothing moved for 'quiet' or 'max_delay' passed since the first one.
+    // The paths are relative to the root, they may be gone by now. The
+    // directories still there are new ones, with everything under them. An
+    // overflow means the kernel dropped events and only a rescan can tell
+    // what changed.
+    std::set<std::string> wait(std::chrono::milliseconds timeout,
+                               std::chrono::milliseconds quiet,
+                               std::chrono::milliseconds max_delay,
+                               bool& overflow);
+
+private:
+    bool read_events(std::set<std::string>& changed, bool& overflow);
+    // a new directory may have got files before its watch was in place.
+    void add_watches(const std::string& dir, std::set<std::string>* changed);
+
+private:
+    const std::filesystem::path m_root;
+    const std::string m_folder;
+    int m_fd = -1;
+    // watch descriptor to the directory, relative to the root.
+    std::unordered_map<int, std::string> m_dirs;
+};
+
+} // namespace metriffic
+
+#endif //WORKSPACE_WATCHER_HPP